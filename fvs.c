@@ -10,8 +10,35 @@
 
 #define ASSERT RT_ASSERT
 
+/* The status of a vnode is FVS_VN_STATUS_EMPTY until the data is written.
+ * Then it's programmed to the sequence number of the write. The sequence
+ * number increases on each write of the same (id, size) so the newest record
+ * could be told by comparing two of them. */
 #define FVS_VN_STATUS_EMPTY   ((fvs_native_t)-1)
-#define FVS_VN_STATUS_WRITTEN ((fvs_native_t)0x0)
+
+/* the tombstone flag in size field. A tombstone record has no data. */
+#define FVS_VN_TOMB  ((fvs_size_t)1 << (sizeof(fvs_size_t) * 8 - 1))
+/* The patch flag in size field. The data of a patch record is a fixed number
+ * of (index, value) pairs of the changed words, told by vn_patch_pairs from
+ * the size, so the record could be walked over without reading its data. The
+ * unused pairs are left erased. The patches are applied on the newest full
+ * record in the order of sequence number. */
+#define FVS_VN_PATCH ((fvs_size_t)1 << (sizeof(fvs_size_t) * 8 - 2))
+/* The directory flag in size field. The directory is the first record of the
+ * page written on rolling, with id 0 and the number of entries in size. It's
+ * followed by the compacted region, which is the records sorted by (id, size).
+ * Each entry is the offset of a record from the page. */
+#define FVS_VN_DIR   ((fvs_size_t)1 << (sizeof(fvs_size_t) * 8 - 3))
+#define FVS_VN_FLAGS (FVS_VN_TOMB | FVS_VN_PATCH | FVS_VN_DIR)
+
+/* round sz up to the whole program units */
+#define FVS_UNIT_ALIGN(sz) (((sz) + FVS_PROG_UNIT - 1) & ~(FVS_PROG_UNIT - 1))
+
+/* number of words to be handled at once when patching, buffered on stack */
+#define FVS_VN_CHUNK 8
+
+/* number of keys selected in one walk of the page when rolling */
+#define FVS_VN_SEL_NR 8
 
 static rt_err_t vn_do_create(
 		rt_uint8_t *base_addr,
@@ -22,16 +49,707 @@ static rt_err_t vn_do_create(
 static rt_err_t vn_fill_data(
 		rt_uint8_t *base_addr,
 		struct fvs_vnode *node,
-		void* data);
+		void* data,
+		fvs_native_t seq);
+
+static void vn_mark_written(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		fvs_native_t seq);
+
+static struct fvs_vnode *vn_find(
+		rt_uint8_t *base_addr,
+		size_t page_sz,
+		fvs_id_t id,
+		size_t size);
+
+#ifdef FVS_USING_GOVERNOR
+static struct fvs_gov_slot *gov_slot_of(
+		struct fvs_governor *gov,
+		fvs_id_t id,
+		fvs_size_t size);
+#endif
+
+#ifdef FVS_USING_TRACE
+static struct {
+	struct fvs_trace_event evt[FVS_TRACE_NR];
+	/* the number of events ever recorded and the number of events consumed */
+	rt_uint32_t head, tail;
+	/* the number of events overwritten before being read */
+	rt_uint32_t lost;
+} _trace;
+
+static void vn_trace(rt_uint8_t op, fvs_id_t id, fvs_size_t size)
+{
+	struct fvs_trace_event *evt;
+	rt_base_t level;
+
+	level = rt_hw_interrupt_disable();
+	if (_trace.head - _trace.tail == FVS_TRACE_NR) {
+		_trace.tail++;
+		_trace.lost++;
+	}
+	evt = &_trace.evt[_trace.head++ & (FVS_TRACE_NR - 1)];
+	evt->tick = rt_tick_get();
+	evt->id   = id;
+	evt->size = size;
+	evt->op   = op;
+	rt_hw_interrupt_enable(level);
+}
+
+rt_size_t fvs_trace_read(struct fvs_trace_event *buf, rt_size_t nr)
+{
+	rt_size_t i;
+	rt_base_t level;
+
+	level = rt_hw_interrupt_disable();
+	for (i = 0; i < nr && _trace.tail != _trace.head; i++)
+		buf[i] = _trace.evt[_trace.tail++ & (FVS_TRACE_NR - 1)];
+	rt_hw_interrupt_enable(level);
+
+	return i;
+}
+
+rt_uint32_t fvs_trace_lost(void)
+{
+	rt_uint32_t lost;
+	rt_base_t level;
+
+	level = rt_hw_interrupt_disable();
+	lost = _trace.lost;
+	_trace.lost = 0;
+	rt_hw_interrupt_enable(level);
+
+	return lost;
+}
+
+void fvs_trace_dump(void)
+{
+	struct fvs_trace_event evt;
+	rt_uint32_t lost = fvs_trace_lost();
+
+	if (lost)
+		rt_kprintf("FVS: %d trace events lost\n", lost);
+
+	while (fvs_trace_read(&evt, 1))
+		rt_kprintf("FVS-T %u %c %u %u\n",
+				evt.tick, evt.op, evt.id, evt.size);
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+FINSH_FUNCTION_EXPORT(fvs_trace_dump, dump the fvs operation trace);
+#endif
+
+#define FVS_TRACE(op, id, size) vn_trace(op, id, size)
+#else
+#define FVS_TRACE(op, id, size)
+#endif
+
+#ifdef FVS_HAL_NO_MMAP
+/* The flash could only be read by fvs_read. The records are read through a
+ * small cache of lines aligned to FVS_CACHE_LINE_SZ, the data larger than a
+ * line is read in one transfer. The cache is written through when the flash
+ * is programmed. */
+static struct fl_line {
+	/* RT_NULL for invalid line */
+	rt_uint8_t *addr;
+	rt_uint32_t used;
+	fvs_native_t data[FVS_CACHE_LINE_SZ / sizeof(fvs_native_t)];
+} _cache[FVS_CACHE_LINE_NR];
+static rt_uint32_t _cache_clock;
+/* The error of fvs_read since the API is called. The flash looks erased from
+ * a failed read on, so the walks end there. The content is not real, so the
+ * flash is never programmed or erased after it and the error is returned by
+ * the API. */
+static rt_err_t _fl_err;
+
+static struct fl_line *fl_line_of(const void *addr)
+{
+	rt_uint8_t *base = (rt_uint8_t*)((rt_ubase_t)addr & ~(FVS_CACHE_LINE_SZ - 1));
+	struct fl_line *line, *victim = _cache;
+
+	for (line = _cache; line < _cache + FVS_CACHE_LINE_NR; line++) {
+		if (line->addr == base)
+			goto out;
+		if (line->used < victim->used)
+			victim = line;
+	}
+
+	/* replace the least recently used line */
+	line = victim;
+	if (_fl_err != RT_EOK ||
+	    fvs_read(base, line->data, FVS_CACHE_LINE_SZ) != RT_EOK) {
+		_fl_err = -RT_EIO;
+		fvs_cache_invalidate();
+		rt_memset(line->data, 0xFF, FVS_CACHE_LINE_SZ);
+		return line;
+	}
+	line->addr = base;
+out:
+	line->used = ++_cache_clock;
+	return line;
+}
+
+rt_inline fvs_native_t fl_load_word(const void *addr)
+{
+	struct fl_line *line = fl_line_of(addr);
+
+	return line->data[((rt_ubase_t)addr & (FVS_CACHE_LINE_SZ - 1)) /
+	                  sizeof(fvs_native_t)];
+}
+
+static void fl_read(const void *addr, void *buf, rt_size_t len)
+{
+	const rt_uint8_t *src = addr;
+	rt_uint8_t *dst = buf;
+
+	if (len >= FVS_CACHE_LINE_SZ) {
+		if (_fl_err != RT_EOK || fvs_read((void*)addr, buf, len) != RT_EOK) {
+			_fl_err = -RT_EIO;
+			fvs_cache_invalidate();
+			rt_memset(buf, 0xFF, len);
+		}
+		return;
+	}
+
+	while (len) {
+		struct fl_line *line = fl_line_of(src);
+		rt_size_t off = (rt_ubase_t)src & (FVS_CACHE_LINE_SZ - 1);
+		rt_size_t l = FVS_CACHE_LINE_SZ - off;
+
+		if (l > len)
+			l = len;
+		rt_memcpy(dst, (rt_uint8_t*)line->data + off, l);
+		src += l;
+		dst += l;
+		len -= l;
+	}
+}
+
+/* update the cached lines covering the programmed area */
+static void fl_update(void *addr, const void *data, rt_size_t len)
+{
+	struct fl_line *line;
+	rt_uint8_t *a = addr;
+
+	for (line = _cache; line < _cache + FVS_CACHE_LINE_NR; line++) {
+		rt_uint8_t *s, *e;
+
+		if (line->addr == RT_NULL)
+			continue;
+		s = a > line->addr ? a : line->addr;
+		e = a + len < line->addr + FVS_CACHE_LINE_SZ ?
+			a + len : line->addr + FVS_CACHE_LINE_SZ;
+		if (s < e)
+			rt_memcpy((rt_uint8_t*)line->data + (s - line->addr),
+					(const rt_uint8_t*)data + (s - a), e - s);
+	}
+}
+
+void fvs_cache_invalidate(void)
+{
+	struct fl_line *line;
+
+	for (line = _cache; line < _cache + FVS_CACHE_LINE_NR; line++)
+		line->addr = RT_NULL;
+}
+#define fl_invalidate() fvs_cache_invalidate()
+#define fl_clear_error() (_fl_err = RT_EOK)
+#define fl_error() _fl_err
+#else
+#define fl_load_word(addr) (*(const fvs_native_t*)(addr))
+#define fl_read(addr, buf, len) rt_memcpy(buf, addr, len)
+#define fl_update(addr, data, len)
+#define fl_invalidate()
+#define fl_clear_error()
+#define fl_error() RT_EOK
+#endif
+/* the error of the reads if any, otherwise res */
+rt_inline rt_err_t fl_result(rt_err_t res)
+{
+	return fl_error() != RT_EOK ? fl_error() : res;
+}
+
+/* The flash is programmed in units of FVS_PROG_UNIT bytes and each unit is
+ * programmed only once. The writes are combined in the unit buffer, which is
+ * programmed when it's full, when the writes move to another unit or when the
+ * write ends. The rest of the unit is left as erased. */
+static struct {
+	/* RT_NULL if nothing is buffered */
+	rt_uint8_t *addr;
+	fvs_native_t data[FVS_PROG_UNIT / sizeof(fvs_native_t)];
+} _wc;
+
+static rt_err_t fl_flush(void)
+{
+	rt_err_t res;
+
+	if (_wc.addr == RT_NULL)
+		return RT_EOK;
+	if (fl_error() != RT_EOK) {
+		_wc.addr = RT_NULL;
+		return fl_error();
+	}
+
+	res = fvs_native_write_m(_wc.addr, (rt_uint8_t*)_wc.data, FVS_PROG_UNIT);
+	fl_update(_wc.addr, _wc.data, FVS_PROG_UNIT);
+	_wc.addr = RT_NULL;
+	return res;
+}
+
+/* the word at addr, including the one still in the unit buffer */
+rt_inline fvs_native_t fl_word(const void *addr)
+{
+	if (FVS_PROG_UNIT > sizeof(fvs_native_t) && _wc.addr != RT_NULL &&
+	    (rt_ubase_t)((rt_uint8_t*)addr - _wc.addr) < FVS_PROG_UNIT)
+		return _wc.data[((rt_uint8_t*)addr - _wc.addr) / sizeof(fvs_native_t)];
+	return fl_load_word(addr);
+}
+
+static rt_err_t fl_write_m(void *addr, const void *data, rt_size_t len)
+{
+	rt_uint8_t *a = addr;
+	const rt_uint8_t *d = data;
+	rt_err_t res = RT_EOK;
+
+	ASSERT(((rt_ubase_t)a & (sizeof(fvs_native_t)-1)) == 0);
+
+	while (len) {
+		rt_uint8_t *unit = (rt_uint8_t*)((rt_ubase_t)a & ~(FVS_PROG_UNIT - 1));
+		rt_size_t l, off = a - unit;
+
+		if (fl_error() != RT_EOK)
+			return fl_error();
+
+		if (_wc.addr != unit)
+			res = fl_flush();
+
+		if (off == 0 && len >= FVS_PROG_UNIT) {
+			/* the whole units are programmed in one go */
+			l = len & ~(FVS_PROG_UNIT - 1);
+			res = fvs_native_write_m(a, (rt_uint8_t*)d, l);
+			fl_update(a, d, l);
+		} else {
+			if (_wc.addr != unit) {
+				_wc.addr = unit;
+				rt_memset(_wc.data, 0xFF, FVS_PROG_UNIT);
+			}
+			l = FVS_PROG_UNIT - off < len ? FVS_PROG_UNIT - off : len;
+			rt_memcpy((rt_uint8_t*)_wc.data + off, d, l);
+			if (off + l == FVS_PROG_UNIT)
+				res = fl_flush();
+		}
+		a += l;
+		d += l;
+		len -= l;
+	}
+	return res;
+}
+
+rt_inline rt_err_t fl_write_r(void *addr, fvs_native_t data)
+{
+	return fl_write_m(addr, &data, sizeof(data));
+}
+
+/* the buffered unit should be programmed before the write ends */
+rt_inline rt_err_t fl_end_write(void *addr)
+{
+	fl_flush();
+	return fvs_end_write(addr);
+}
+
+static rt_err_t fl_erase(void *addr)
+{
+	rt_err_t res;
+
+	if (fl_error() != RT_EOK)
+		return fl_error();
+	res = fvs_erase_page(addr);
+	fl_invalidate();
+	return res;
+}
+
+rt_inline fvs_id_t vn_id(struct fvs_vnode *node)
+{
+	return fl_word(&node->id);
+}
+
+rt_inline fvs_size_t vn_size(struct fvs_vnode *node)
+{
+	return fl_word(&node->size);
+}
+
+/* the number of data words of node, 0 if the flash could not be read */
+rt_inline fvs_size_t vn_words(struct fvs_vnode *node)
+{
+	fvs_size_t size = vn_size(node);
+
+	return fl_error() == RT_EOK ? size / sizeof(fvs_native_t) : 0;
+}
+
+rt_inline fvs_native_t vn_status(struct fvs_vnode *node)
+{
+	return fl_word(&FVS_VN_STATUS(node));
+}
+
+/* the number of (index, value) pairs in a patch of the vnode with size bytes.
+ * 0 if a patch would not be smaller than a full copy. */
+rt_inline fvs_size_t vn_patch_pairs(fvs_size_t size)
+{
+	fvs_size_t n = FVS_PATCH_PAIR_NR;
+
+	while (n && FVS_UNIT_ALIGN(2 * n * sizeof(fvs_native_t)) >=
+			FVS_UNIT_ALIGN(size))
+		n--;
+	return n;
+}
+
+rt_inline fvs_size_t vn_data_len(struct fvs_vnode *node)
+{
+	if (vn_size(node) & FVS_VN_TOMB)
+		return 0;
+	if (vn_size(node) & FVS_VN_PATCH)
+		return 2 * vn_patch_pairs(vn_size(node) & ~FVS_VN_FLAGS) *
+			sizeof(fvs_native_t);
+	if (vn_size(node) & FVS_VN_DIR)
+		return (vn_size(node) & ~FVS_VN_FLAGS) * sizeof(fvs_native_t);
+	return vn_size(node);
+}
+
+/* the bytes taken by the record with len bytes of data */
+rt_inline size_t vn_rec_len(size_t len)
+{
+	return sizeof(struct fvs_vnode) + FVS_UNIT_ALIGN(len);
+}
 
 rt_inline struct fvs_vnode* vn_next(struct fvs_vnode *node)
 {
-	return (struct fvs_vnode*)((char*)node + sizeof(*node) + node->size);
+	return (struct fvs_vnode*)((char*)node + vn_rec_len(vn_data_len(node)));
 }
 
+/* records invalidated by the old versions of FVS have id 0 */
 rt_inline int vn_is_valid(struct fvs_vnode *node)
 {
-	return node->id != 0;
+	return vn_id(node) != 0;
+}
+
+rt_inline int vn_is_empty(struct fvs_vnode *node)
+{
+	return vn_status(node) == FVS_VN_STATUS_EMPTY;
+}
+
+rt_inline int vn_is_tomb(struct fvs_vnode *node)
+{
+	return (vn_size(node) & FVS_VN_TOMB) != 0;
+}
+
+rt_inline int vn_is_patch(struct fvs_vnode *node)
+{
+	return (vn_size(node) & FVS_VN_PATCH) != 0;
+}
+
+rt_inline int vn_is_dir(struct fvs_vnode *node)
+{
+	return (vn_size(node) & FVS_VN_DIR) != 0 && !vn_is_empty(node);
+}
+
+/* whether (a_id, a_size) is sorted before (b_id, b_size) */
+rt_inline int vn_key_less(
+		fvs_id_t a_id,
+		fvs_size_t a_size,
+		fvs_id_t b_id,
+		fvs_size_t b_size)
+{
+	return a_id < b_id || (a_id == b_id && a_size < b_size);
+}
+
+/* Binary search (id, size) in the compacted region of the page. The found
+ * record is returned in found, or RT_NULL if not found.
+ *
+ * @return the first record appended after the compacted region.
+ */
+static struct fvs_vnode *vn_dir_search(
+		rt_uint8_t *base_addr,
+		fvs_id_t id,
+		fvs_size_t size,
+		struct fvs_vnode **found)
+{
+	struct fvs_vnode *dir = (struct fvs_vnode*)base_addr, *node;
+	fvs_native_t *ent = (fvs_native_t*)(dir+1);
+	fvs_size_t lo = 0, hi, mid;
+
+	if (found)
+		*found = RT_NULL;
+	if (!vn_is_dir(dir))
+		return dir;
+
+	hi = vn_size(dir) & ~FVS_VN_FLAGS;
+	while (found && lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		node = (struct fvs_vnode*)(base_addr + fl_word(&ent[mid]));
+		if (vn_id(node) == id && vn_size(node) == size) {
+			*found = node;
+			break;
+		}
+		if (vn_key_less(vn_id(node), vn_size(node), id, size))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* the compacted region ends after the record of the last entry */
+	hi = vn_size(dir) & ~FVS_VN_FLAGS;
+	if (hi == 0)
+		return vn_next(dir);
+	return vn_next((struct fvs_vnode*)(base_addr + fl_word(&ent[hi-1])));
+}
+
+/* whether sequence number a is newer than b */
+rt_inline int vn_seq_after(fvs_native_t a, fvs_native_t b)
+{
+	fvs_native_t d = a - b;
+
+	return d != 0 && d <= ((fvs_native_t)-1 >> 1);
+}
+
+rt_inline fvs_native_t vn_seq_next(fvs_native_t seq)
+{
+	seq++;
+	if (seq == FVS_VN_STATUS_EMPTY)
+		seq = 0;
+	return seq;
+}
+
+/* whether node replaces cur as the current record of their (id, size) */
+rt_inline int vn_newer(struct fvs_vnode *node, struct fvs_vnode *cur)
+{
+	if (cur == RT_NULL)
+		return 1;
+	if (vn_is_empty(node))
+		return vn_is_tomb(cur);
+	return vn_is_empty(cur) ||
+	       vn_seq_after(vn_status(node), vn_status(cur));
+}
+
+/* a key selected by vn_select with its current record */
+struct vn_sel {
+	fvs_id_t id;
+	fvs_size_t size;
+	struct fvs_vnode *node;
+};
+
+/* Select the FVS_VN_SEL_NR smallest (id, size) after (prev_id, prev_size) with
+ * their current records in one walk of the page, sorted by the key. A key
+ * dropped for a smaller one would never be selected again in the walk, as the
+ * largest key kept only decreases, so every kept key has seen all its records.
+ *
+ * @return the number of the keys selected, 0 if no key is left.
+ */
+static int vn_select(
+		rt_uint8_t *base_addr,
+		size_t page_sz,
+		fvs_id_t prev_id,
+		fvs_size_t prev_size,
+		struct vn_sel *sel)
+{
+	struct fvs_vnode *node;
+	int i, j, nr = 0;
+
+	for (node = (struct fvs_vnode*)base_addr;
+			vn_id(node) != FVS_END_OF_ID;
+			node = vn_next(node)) {
+		fvs_id_t id = vn_id(node);
+		fvs_size_t size = vn_size(node) & ~FVS_VN_FLAGS;
+
+		ASSERT((char*)node < (char*)(base_addr) + page_sz);
+
+		if (!vn_is_valid(node) || vn_is_patch(node) ||
+		    !vn_key_less(prev_id, prev_size, id, size))
+			continue;
+		if (nr == FVS_VN_SEL_NR &&
+		    vn_key_less(sel[nr-1].id, sel[nr-1].size, id, size))
+			continue;
+
+		for (i = 0; i < nr && vn_key_less(sel[i].id, sel[i].size, id, size); i++)
+			;
+		if (i < nr && sel[i].id == id && sel[i].size == size) {
+			if (vn_newer(node, sel[i].node))
+				sel[i].node = node;
+			continue;
+		}
+
+		/* drop the largest one if full */
+		if (nr < FVS_VN_SEL_NR)
+			nr++;
+		for (j = nr - 1; j > i; j--)
+			sel[j] = sel[j-1];
+		sel[i].id = id;
+		sel[i].size = size;
+		sel[i].node = node;
+	}
+	return nr;
+}
+
+/* whether p is a committed patch newer than node */
+rt_inline int vn_is_patch_of(struct fvs_vnode *p, struct fvs_vnode *node)
+{
+	return vn_id(p) == vn_id(node) && vn_size(p) == (vn_size(node) | FVS_VN_PATCH) &&
+	       !vn_is_empty(p) && vn_seq_after(vn_status(p), vn_status(node));
+}
+
+/* the first record which could be a patch of node. The patches are merged
+ * on rolling, so they are only appended after the compacted region. */
+rt_inline struct fvs_vnode *vn_patch_start(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node)
+{
+	struct fvs_vnode *p = vn_next(node);
+	struct fvs_vnode *tail = vn_dir_search(base_addr, 0, 0, RT_NULL);
+
+	return p < tail ? tail : p;
+}
+
+/* Load nr words of the current value of node from word idx into buf, with the
+ * patches on node applied. */
+static void vn_load(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		fvs_size_t idx,
+		fvs_native_t *buf,
+		fvs_size_t nr)
+{
+	struct fvs_vnode *p;
+	fvs_native_t *pair, i, n = vn_patch_pairs(vn_size(node));
+
+	fl_read((fvs_native_t*)(node+1) + idx, buf, nr * sizeof(*buf));
+	if (vn_is_empty(node))
+		return;
+
+	for (p = vn_patch_start(base_addr, node);
+			vn_id(p) != FVS_END_OF_ID;
+			p = vn_next(p)) {
+		if (!vn_is_patch_of(p, node))
+			continue;
+		pair = (fvs_native_t*)(p+1);
+		for (i = 0; i < n; i++) {
+			fvs_native_t w = fl_word(&pair[2*i]);
+
+			if (w == (fvs_native_t)-1)
+				break;
+			if (w >= idx && w < idx + nr)
+				buf[w - idx] = fl_word(&pair[2*i + 1]);
+		}
+	}
+}
+
+/* @return the number of patches on node, and the newest sequence number of
+ * node in seq. */
+static int vn_patch_nr(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		fvs_native_t *seq)
+{
+	struct fvs_vnode *p;
+	int nr = 0;
+
+	*seq = vn_status(node);
+	if (vn_is_empty(node))
+		return 0;
+
+	for (p = vn_patch_start(base_addr, node);
+			vn_id(p) != FVS_END_OF_ID;
+			p = vn_next(p)) {
+		if (!vn_is_patch_of(p, node))
+			continue;
+		nr++;
+		if (vn_seq_after(vn_status(p), *seq))
+			*seq = vn_status(p);
+	}
+	return nr;
+}
+
+/* @return the number of words differ between data and the value of node */
+static fvs_size_t vn_diff(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		const void *data)
+{
+	fvs_native_t buf[FVS_VN_CHUNK];
+	const fvs_native_t *d = data;
+	fvs_size_t idx, i, nr, n = 0;
+	fvs_size_t words = vn_words(node);
+
+	for (idx = 0; idx < words; idx += nr) {
+		nr = words - idx < FVS_VN_CHUNK ? words - idx : FVS_VN_CHUNK;
+		vn_load(base_addr, node, idx, buf, nr);
+		for (i = 0; i < nr; i++) {
+			if (buf[i] != d[idx + i])
+				n++;
+		}
+	}
+	return n;
+}
+
+/* write the current value of src on src_base to node, which is just created */
+static void vn_fill_value(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		rt_uint8_t *src_base,
+		struct fvs_vnode *src,
+		fvs_native_t seq)
+{
+	fvs_native_t buf[FVS_VN_CHUNK];
+	fvs_size_t idx, nr;
+	fvs_size_t words = vn_words(src);
+
+	fvs_verbose("FVS: fill node 0x%p with value of 0x%p\n", node, src);
+
+	fvs_begin_write(base_addr);
+	for (idx = 0; idx < words; idx += nr) {
+		nr = words - idx < FVS_VN_CHUNK ? words - idx : FVS_VN_CHUNK;
+		vn_load(src_base, src, idx, buf, nr);
+		fl_write_m((fvs_native_t*)(node+1) + idx,
+				(rt_uint8_t*)buf, nr * sizeof(fvs_native_t));
+	}
+	vn_mark_written(base_addr, node, seq);
+	fl_end_write(base_addr);
+}
+
+/* append the n changed words of data on node as a patch record */
+static void vn_write_patch(
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *patch,
+		struct fvs_vnode *node,
+		const void *data,
+		fvs_size_t n,
+		fvs_native_t seq)
+{
+	fvs_native_t buf[FVS_VN_CHUNK], *ptr = (fvs_native_t*)(patch+1);
+	const fvs_native_t *d = data;
+	fvs_size_t idx, i, nr;
+	fvs_size_t words = vn_words(node);
+
+	ASSERT(n <= vn_patch_pairs(vn_size(node)));
+	fvs_verbose("FVS: patch %d words of node 0x%p on 0x%p\n", n, node, patch);
+
+	vn_do_create(base_addr, patch, vn_id(node), vn_size(node) | FVS_VN_PATCH);
+
+	fvs_begin_write(base_addr);
+	/* stop once the n changed words are written */
+	for (idx = 0; n && idx < words; idx += nr) {
+		nr = words - idx < FVS_VN_CHUNK ? words - idx : FVS_VN_CHUNK;
+		vn_load(base_addr, node, idx, buf, nr);
+		for (i = 0; n && i < nr; i++) {
+			if (buf[i] == d[idx + i])
+				continue;
+			fl_write_r(ptr++, idx + i);
+			fl_write_r(ptr++, d[idx + i]);
+			n--;
+		}
+	}
+	vn_mark_written(base_addr, patch, seq);
+	fl_end_write(base_addr);
 }
 
 rt_inline void blk_mark_as_using(
@@ -42,8 +760,8 @@ rt_inline void blk_mark_as_using(
 
 	fvs_verbose("FVS: mark page 0x%p as using\n", base_addr);
 	fvs_begin_write(base_addr);
-	fvs_native_write_r((void*)&node->status, 0);
-	fvs_end_write(base_addr);
+	fl_write_r((void*)&FVS_VN_STATUS(node), 0);
+	fl_end_write(base_addr);
 }
 
 rt_inline rt_bool_t blk_page_inuse(
@@ -51,7 +769,7 @@ rt_inline rt_bool_t blk_page_inuse(
 		int idx)
 {
 	struct fvs_vnode *node = (struct fvs_vnode*)(page->pages[idx] + page->size);
-	return node->status == 0;
+	return vn_status(node) == 0;
 }
 
 rt_inline rt_uint8_t* blk_find_using(
@@ -63,13 +781,53 @@ rt_inline rt_uint8_t* blk_find_using(
 		if (blk_page_inuse(page, i))
 			return page->pages[i];
 	}
+	/* the flash looks erased after a read error, take the first page like
+	 * vn_get does on the empty block */
+	if (fl_error() != RT_EOK)
+		return page->pages[0];
 	return RT_NULL;
 }
 
-rt_err_t blk_roll_pages(const struct fvs_block *blk)
+/* write the directory of the n records following it */
+static void blk_write_dir(
+		rt_uint8_t *base_addr,
+		fvs_size_t n)
 {
+	struct fvs_vnode *dir = (struct fvs_vnode*)base_addr, *node;
+	fvs_native_t *ptr = (fvs_native_t*)(dir+1);
+
+	vn_do_create(base_addr, dir, 0, n | FVS_VN_DIR);
+
+	fvs_begin_write(base_addr);
+	for (node = vn_next(dir); n; n--, node = vn_next(node))
+		fl_write_r(ptr++, (rt_uint8_t*)node - base_addr);
+	/* the directory is only used after committed */
+	vn_mark_written(base_addr, dir, 0);
+	fl_end_write(base_addr);
+}
+
+/* Copy the live vnodes to the empty page and switch to it. If sub is not
+ * RT_NULL, it is replaced by data on the new page, or dropped if data is
+ * RT_NULL.
+ *
+ * The vnodes are copied in the order of (id, size), by selecting the next one
+ * in each pass over the old page as there is no RAM to sort them. They are
+ * indexed by the directory at the beginning of the new page if there are
+ * enough of them and there is room for it. The reserve bytes are kept free
+ * for the caller. */
+static rt_err_t blk_roll_pages(
+		const struct fvs_block *blk,
+		struct fvs_vnode *sub,
+		void *data,
+		size_t reserve)
+{
+	struct vn_sel sel[FVS_VN_SEL_NR];
 	struct fvs_vnode *node;
 	rt_uint8_t *using_page, *empty_page, *ptr;
+	fvs_id_t prev_id = 0;
+	fvs_size_t size, prev_size = 0, n = 0;
+	size_t s = 0;
+	int i, nr;
 
 	using_page = blk_find_using(blk);
 	ASSERT(using_page);
@@ -82,26 +840,68 @@ rt_err_t blk_roll_pages(const struct fvs_block *blk)
 	fvs_verbose("FVS: rolling pages: from(0x%x), to(0x%x)\n",
 			using_page, empty_page);
 
-	ptr = empty_page;
-	for (node = (struct fvs_vnode*)using_page;
-			node->id != FVS_END_OF_ID;
-			node = vn_next(node)) {
-		if (!vn_is_valid(node))
-			continue;
+	/* only the newest version survives */
+	while ((nr = vn_select(using_page, blk->size, prev_id, prev_size, sel))) {
+		for (i = 0; i < nr; i++) {
+			node = sel[i].node;
+			if (vn_is_tomb(node) || (node == sub && data == RT_NULL))
+				continue;
+			n++;
+			s += vn_rec_len(sel[i].size);
+		}
+		prev_id = sel[nr-1].id;
+		prev_size = sel[nr-1].size;
+	}
 
-		vn_do_create((rt_uint8_t*)empty_page,
-				(struct fvs_vnode*)ptr, node->id, node->size);
-		vn_fill_data((rt_uint8_t*)empty_page,
-				(struct fvs_vnode*)ptr, node+1);
-		ptr += sizeof(struct fvs_vnode) + node->size;
+	/* the directory should not take more than half of the free space, or the
+	 * page would be rolled more often */
+	ptr = empty_page;
+	if (n >= FVS_DIR_MIN_NR &&
+	    s + 2 * vn_rec_len(n * sizeof(fvs_native_t)) + reserve <= blk->size)
+		ptr += vn_rec_len(n * sizeof(fvs_native_t));
+	else
+		n = 0;
+
+	/* copy in the order of (id, size) for the directory */
+	prev_id = 0;
+	prev_size = 0;
+	while ((nr = vn_select(using_page, blk->size, prev_id, prev_size, sel))) {
+		for (i = 0; i < nr; i++) {
+			node = sel[i].node;
+			size = sel[i].size;
+			if (vn_is_tomb(node) || (node == sub && data == RT_NULL))
+				continue;
+
+			vn_do_create((rt_uint8_t*)empty_page,
+					(struct fvs_vnode*)ptr, sel[i].id, size);
+			if (node == sub)
+				vn_fill_data((rt_uint8_t*)empty_page,
+						(struct fvs_vnode*)ptr, data,
+						vn_seq_next(vn_status(node)));
+			else if (!vn_is_empty(node))
+				/* the patches are merged into the new copy */
+				vn_fill_value((rt_uint8_t*)empty_page, (struct fvs_vnode*)ptr,
+						using_page, node, vn_status(node));
+			ptr += vn_rec_len(size);
+		}
+		prev_id = sel[nr-1].id;
+		prev_size = sel[nr-1].size;
 	}
+	if (n)
+		blk_write_dir(empty_page, n);
+
 	/* mark the empty page as using */
 	blk_mark_as_using(empty_page, blk->size);
 
 	/* erase the old page in the last */
 	fvs_begin_write(using_page);
-	fvs_erase_page(using_page);
-	fvs_end_write(using_page);
+	fl_erase(using_page);
+	fl_end_write(using_page);
+
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov)
+		blk->gov->erases++;
+#endif
 
 	return RT_EOK;
 }
@@ -117,96 +917,234 @@ static rt_err_t vn_do_create(
 	fvs_verbose("FVS: do create vnode on 0x%p, ", node);
 	fvs_verbose("id: %d, size %d\n", id, size);
 
-	fvs_native_write_r((void*)&node->id, id);
-	fvs_native_write_r((void*)&node->size, size);
-	fvs_native_write_r((void*)&node->status, FVS_VN_STATUS_EMPTY);
+	fl_write_r((void*)&node->id, id);
+	fl_write_r((void*)&node->size, size);
+	/* the status is left as erased, it's programmed on commit */
 
-	fvs_end_write(base_addr);
+	fl_end_write(base_addr);
 
 	return RT_EOK;
 }
 
 static void vn_mark_written(
 		rt_uint8_t *base_addr,
-		struct fvs_vnode *node)
+		struct fvs_vnode *node,
+		fvs_native_t seq)
 {
 	fvs_begin_write(base_addr);
 
 	fvs_verbose("FVS: mark 0x%p as written, ", node);
-	fvs_verbose("id: %d, size %d\n", node->id, node->size);
-
-	fvs_native_write_r((void*)&node->status, FVS_VN_STATUS_WRITTEN);
-
-	fvs_end_write(base_addr);
-}
-
-static int vn_is_empty(struct fvs_vnode *node)
-{
-	return node->status == FVS_VN_STATUS_EMPTY;
-}
-
-static void vn_mark_invalid(
-		rt_uint8_t *base_addr,
-		struct fvs_vnode *node)
-{
-	fvs_begin_write(base_addr);
+	fvs_verbose("id: %d, size %d, seq %d\n", vn_id(node), vn_size(node), seq);
 
-	fvs_verbose("FVS: mark 0x%p as invalid, ", node);
-	fvs_verbose("id: %d, size %d\n", node->id, node->size);
-	fvs_native_write_r((void*)&node->id, 0);
+	ASSERT(seq != FVS_VN_STATUS_EMPTY);
+	fl_write_r((void*)&FVS_VN_STATUS(node), seq);
 
-	fvs_end_write(base_addr);
+	fl_end_write(base_addr);
 }
 
+/* Find the current full record of (id, size).
+ *
+ * The committed record with the newest sequence number wins. The tombstone
+ * hides the older records. The patches do not count here, they are applied
+ * on the full record when reading. An uncommitted record is a vnode created by
+ * fvs_vnode_get but not written yet, it's only current when there is no live
+ * committed record, otherwise it's the leftover of an interrupted write.
+ *
+ * The compacted region of the page is binary searched, only the records
+ * appended after it are scanned.
+ *
+ * @return the current record or the end of the page if not found.
+ */
 static struct fvs_vnode *vn_find(
 		rt_uint8_t *base_addr,
 		size_t page_sz,
 		fvs_id_t id,
 		size_t size)
 {
-	struct fvs_vnode *node;
+	struct fvs_vnode *node, *cur;
 
 	ASSERT(base_addr);
 
-	/* return the pointer to data if it has been created. */
-	for (node = (struct fvs_vnode*)base_addr;
-			node->id != FVS_END_OF_ID;
+	/* the compacted record is older than the appended ones */
+	for (node = vn_dir_search(base_addr, id, size, &cur);
+			vn_id(node) != FVS_END_OF_ID;
 			node = vn_next(node)) {
-		fvs_debug("FVS: vn_found node id:%d, size: %d\n", node->id, node->size);
+		fvs_debug("FVS: vn_found node id:%d, size: %d\n", vn_id(node), vn_size(node));
 		ASSERT((char*)node < (char*)(base_addr) + page_sz);
 
-		if ((node->id) == id && node->size == size)
-			return node;
+		if (vn_id(node) != id || (vn_size(node) & ~FVS_VN_FLAGS) != size)
+			continue;
+		if (vn_is_patch(node))
+			continue;
+
+		if (vn_newer(node, cur))
+			cur = node;
 	}
-	return node;
+
+	if (cur == RT_NULL || vn_is_tomb(cur))
+		return node;
+	return cur;
 }
 
-size_t fvs_page_used_size(const struct fvs_block *blk)
+/* the sequence number for the next write of (id, size) */
+static fvs_native_t vn_seq_of_next(
+		rt_uint8_t *base_addr,
+		fvs_id_t id,
+		fvs_size_t size)
 {
-	size_t s = 0;
-	struct fvs_vnode *node;
-	for (node = (struct fvs_vnode*)blk->pages;
-			node->id != FVS_END_OF_ID;
-			node = vn_next(node))
-	{
-		if (!vn_is_valid(node))
+	struct fvs_vnode *node, *cur;
+	fvs_native_t seq = FVS_VN_STATUS_EMPTY;
+
+	node = vn_dir_search(base_addr, id, size, &cur);
+	if (cur && !vn_is_empty(cur))
+		seq = vn_status(cur);
+	for (; vn_id(node) != FVS_END_OF_ID; node = vn_next(node)) {
+		if (vn_id(node) != id || (vn_size(node) & ~FVS_VN_FLAGS) != size)
 			continue;
-		s += node->size;
+		if (vn_is_empty(node))
+			continue;
+		if (seq == FVS_VN_STATUS_EMPTY || vn_seq_after(vn_status(node), seq))
+			seq = vn_status(node);
+	}
+	return vn_seq_next(seq);
+}
+
+/* the bytes used by live vnodes on the page */
+static size_t vn_live_size(
+		rt_uint8_t *base_addr,
+		size_t page_sz,
+		rt_bool_t with_meta)
+{
+	struct vn_sel sel[FVS_VN_SEL_NR];
+	fvs_id_t prev_id = 0;
+	fvs_size_t prev_size = 0;
+	size_t s = 0;
+	int i, nr;
+
+	while ((nr = vn_select(base_addr, page_sz, prev_id, prev_size, sel))) {
+		for (i = 0; i < nr; i++) {
+			if (vn_is_tomb(sel[i].node))
+				continue;
+			if (with_meta)
+				s += vn_rec_len(sel[i].size);
+			else
+				s += sel[i].size;
+		}
+		prev_id = sel[nr-1].id;
+		prev_size = sel[nr-1].size;
 	}
 	return s;
 }
 
+size_t fvs_page_used_size(const struct fvs_block *blk)
+{
+	rt_uint8_t *base_addr;
+
+	fl_clear_error();
+	base_addr = blk_find_using(blk);
+
+	if (base_addr == RT_NULL)
+		return 0;
+	return vn_live_size(base_addr, blk->size, RT_FALSE);
+}
+
 rt_bool_t fvs_page_used(const struct fvs_block *blk)
 {
     /* if there no blk we are using, the page would be never be written. */
+	fl_clear_error();
 	return blk_find_using(blk) != RT_NULL;
 }
 
-void *fvs_vnode_get(const struct fvs_block *blk, fvs_id_t id, size_t size)
+#ifndef FVS_HAL_NO_MMAP
+/* the vnodes whose data has been pointed by fvs_vnode_get, replaced in round
+ * robin. */
+static struct {
+	const struct fvs_block *blk;
+	fvs_id_t id;
+	fvs_size_t size;
+} _pointed[FVS_POINTED_NR];
+static rt_uint32_t _pointed_next;
+
+static void vn_set_pointed(
+		const struct fvs_block *blk,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	int i;
+
+	for (i = 0; i < FVS_POINTED_NR; i++) {
+		if (_pointed[i].blk == blk && _pointed[i].id == id &&
+		    _pointed[i].size == size)
+			return;
+	}
+	i = _pointed_next++ % FVS_POINTED_NR;
+	_pointed[i].blk = blk;
+	_pointed[i].id = id;
+	_pointed[i].size = size;
+}
+
+/* whether the data of (id, size) has been pointed by fvs_vnode_get */
+rt_inline int vn_is_pointed(
+		const struct fvs_block *blk,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	int i;
+
+	for (i = 0; i < FVS_POINTED_NR; i++) {
+		if (_pointed[i].blk == blk && _pointed[i].id == id &&
+		    _pointed[i].size == size)
+			return 1;
+	}
+	return 0;
+}
+#else
+#define vn_is_pointed(blk, id, size) 0
+#endif
+
+/* write the patched value of node as a full record so it could be pointed */
+static struct fvs_vnode *vn_fold(
+		const struct fvs_block *blk,
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		fvs_native_t seq)
+{
+	struct fvs_vnode *new_node;
+
+	new_node = vn_find(base_addr, blk->size, FVS_END_OF_ID, (fvs_size_t)-1);
+	if ((rt_uint8_t*)new_node + vn_rec_len(vn_size(node)) > base_addr + blk->size) {
+		fvs_id_t id = vn_id(node);
+		fvs_size_t size = vn_size(node);
+
+		/* rolling merges the patches */
+		blk_roll_pages(blk, RT_NULL, RT_NULL, 0);
+		base_addr = blk_find_using(blk);
+		return vn_find(base_addr, blk->size, id, size);
+	}
+
+	vn_do_create(base_addr, new_node, vn_id(node), vn_size(node));
+	vn_fill_value(base_addr, new_node, base_addr, node, vn_seq_next(seq));
+	return new_node;
+}
+
+/* Get the node of (id, size), create it if not found. If fold is RT_TRUE,
+ * the patched value is written as a full record. That only happens when the
+ * vnode has been written without being pointed before, see vn_is_pointed.
+ * Whether the node is created by this call is returned in created if it is
+ * not RT_NULL. */
+static struct fvs_vnode *vn_get(
+		const struct fvs_block *blk,
+		fvs_id_t id,
+		size_t size,
+		rt_bool_t fold,
+		rt_bool_t *created)
 {
 	struct fvs_vnode *node;
 	rt_uint8_t *base_addr;
-	int s;
+	size_t s;
+
+	if (created)
+		*created = RT_FALSE;
 
 	ASSERT(blk);
 	ASSERT(id);
@@ -224,31 +1162,31 @@ void *fvs_vnode_get(const struct fvs_block *blk, fvs_id_t id, size_t size)
 
 	/* return the pointer to data if it has been created. */
 	node = vn_find(base_addr, blk->size, id, size);
-	if (node->id != FVS_END_OF_ID)
-		return node+1;
+	if (vn_id(node) != FVS_END_OF_ID) {
+		fvs_native_t seq;
 
-	/* there is enough space to create the node we need. */
-	if ((rt_uint8_t*)(node+1) + size <= base_addr + blk->size)
-	{
-		vn_do_create(base_addr, node, id, size);
-		return node+1;
+		if (!fold || vn_patch_nr(base_addr, node, &seq) == 0)
+			return node;
+		return vn_fold(blk, base_addr, node, seq);
 	}
 
-	s = 0;
-	for (node = (struct fvs_vnode*)base_addr;
-			node->id != FVS_END_OF_ID;
-			node = vn_next(node))
+	/* there is enough space to create the node we need. */
+	if ((rt_uint8_t*)node + vn_rec_len(size) <= base_addr + blk->size)
 	{
-		if (!vn_is_valid(node))
-			continue;
-		s += sizeof(*node) + node->size;
+		vn_do_create(base_addr, node, id, size);
+		if (fl_error() != RT_EOK)
+			return RT_NULL;
+		if (created)
+			*created = RT_TRUE;
+		return node;
 	}
 
-	if (s + sizeof(*node) + size > blk->size)
+	s = vn_live_size(base_addr, blk->size, RT_TRUE);
+	if (s + vn_rec_len(size) > blk->size)
 		/* we run out of luck */
 		return NULL;
 
-	blk_roll_pages(blk);
+	blk_roll_pages(blk, RT_NULL, RT_NULL, vn_rec_len(size));
 
 	/* refresh the base_addr as the using page is changed */
 	base_addr = blk_find_using(blk);
@@ -256,61 +1194,151 @@ void *fvs_vnode_get(const struct fvs_block *blk, fvs_id_t id, size_t size)
 
 	/* return the pointer to data if it has been created. */
 	node = vn_find(base_addr, blk->size, id, size);
-	ASSERT(node->id == FVS_END_OF_ID);
-	ASSERT((rt_uint8_t*)(node+1) + size <= base_addr + blk->size);
+	ASSERT(vn_id(node) == FVS_END_OF_ID);
+	ASSERT((rt_uint8_t*)node + vn_rec_len(size) <= base_addr + blk->size);
 
 	vn_do_create(base_addr, node, id, size);
 
-	return node+1;
+	/* the node is not created if the flash could not be read */
+	if (fl_error() != RT_EOK)
+		return RT_NULL;
+	if (created)
+		*created = RT_TRUE;
+	return node;
 }
 
 static rt_err_t vn_fill_data(
 		rt_uint8_t *base_addr,
 		struct fvs_vnode *node,
-		void* data)
+		void* data,
+		fvs_native_t seq)
 {
 	ASSERT(node);
 	ASSERT(data);
-	ASSERT(node->status == FVS_VN_STATUS_EMPTY);
+	ASSERT(vn_status(node) == FVS_VN_STATUS_EMPTY);
 
 	fvs_verbose("FVS: fill node 0x%p with data from 0x%p, ",
 			node, data);
-	fvs_verbose("id: %d, size: %d\n", node->id, node->size);
+	fvs_verbose("id: %d, size: %d\n", vn_id(node), vn_size(node));
 
 	fvs_begin_write(base_addr);
 
-	fvs_native_write_m(node+1, data, node->size);
-	vn_mark_written(base_addr, node);
+	fl_write_m(node+1, data, vn_size(node));
+	vn_mark_written(base_addr, node, seq);
 
-	fvs_end_write(base_addr);
+	fl_end_write(base_addr);
 	return RT_EOK;
 }
 
-void fvs_vnode_delete(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size)
+#ifndef FVS_HAL_NO_MMAP
+void *fvs_vnode_get(const struct fvs_block *blk, fvs_id_t id, size_t size)
+{
+	struct fvs_vnode *node;
+
+	FVS_TRACE(FVS_TRACE_GET, id, size);
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov) {
+		struct fvs_gov_slot *slot = gov_slot_of(blk->gov, id, size);
+
+		/* the coalesced data is newer than the one on flash */
+		if (slot && slot->dirty)
+			return slot->data;
+	}
+#endif
+	node = vn_get(blk, id, size, RT_TRUE, RT_NULL);
+	if (node == RT_NULL)
+		return RT_NULL;
+	vn_set_pointed(blk, id, size);
+	return node+1;
+}
+#endif
+
+/* Find the written record of (id, size) without writing the flash.
+ *
+ * @return RT_NULL if the vnode is absent or not written yet.
+ */
+static struct fvs_vnode *vn_lookup(
+		const struct fvs_block *blk,
+		fvs_id_t id,
+		fvs_size_t size)
 {
 	struct fvs_vnode *node;
 	rt_uint8_t *base_addr;
 
 	ASSERT(blk);
+	ASSERT(id);
 	ASSERT(id != FVS_END_OF_ID);
+	ASSERT((size & (sizeof(fvs_native_t)-1)) == 0);
 
 	base_addr = blk_find_using(blk);
-	if (!base_addr)
-		return;
+	if (base_addr == RT_NULL)
+		return RT_NULL;
 
 	node = vn_find(base_addr, blk->size, id, size);
-	if (node->id == FVS_END_OF_ID)
-		return;
+	if (vn_id(node) == FVS_END_OF_ID || vn_is_empty(node))
+		return RT_NULL;
+	return node;
+}
 
-	fvs_verbose("FVS: delete node 0x%p, ", node);
-	fvs_verbose("id: %d, size: %d\n", id, size);
+rt_err_t fvs_vnode_peek(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size)
+{
+	FVS_TRACE(FVS_TRACE_GET, id, size);
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov) {
+		struct fvs_gov_slot *slot = gov_slot_of(blk->gov, id, size);
 
-	vn_mark_invalid(base_addr, node);
+		if (slot && slot->dirty)
+			return RT_EOK;
+	}
+#endif
+	fl_clear_error();
+	if (vn_lookup(blk, id, size) == RT_NULL)
+		return fl_result(-RT_EEMPTY);
+	return fl_result(RT_EOK);
 }
 
-rt_err_t fvs_vnode_write(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size, void *data)
+rt_err_t fvs_vnode_read(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size, void *buf)
+{
+	struct fvs_vnode *node;
+
+	ASSERT(buf);
+
+	FVS_TRACE(FVS_TRACE_GET, id, size);
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov) {
+		struct fvs_gov_slot *slot = gov_slot_of(blk->gov, id, size);
+
+		if (slot && slot->dirty) {
+			rt_memcpy(buf, slot->data, size);
+			return RT_EOK;
+		}
+	}
+#endif
+	fl_clear_error();
+	node = vn_lookup(blk, id, size);
+	if (node == RT_NULL)
+		return fl_result(-RT_EEMPTY);
+
+	vn_load(blk_find_using(blk), node, 0, buf, size / sizeof(fvs_native_t));
+	return fl_result(RT_EOK);
+}
+
+rt_err_t fvs_vnode_get_copy(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size, void *buf)
 {
-	struct fvs_vnode *node, *new_node;
+	rt_err_t res;
+
+	res = fvs_vnode_read(blk, id, size, buf);
+	/* the absent vnode reads as erased, as fvs_vnode_get returns */
+	if (res == -RT_EEMPTY) {
+		rt_memset(buf, 0xFF, size);
+		res = RT_EOK;
+	}
+	return res;
+}
+
+static void vn_delete(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size)
+{
+	struct fvs_vnode *node, *tomb;
 	rt_uint8_t *base_addr;
 
 	ASSERT(blk);
@@ -318,54 +1346,404 @@ rt_err_t fvs_vnode_write(const struct fvs_block *blk, fvs_id_t id, fvs_size_t si
 
 	base_addr = blk_find_using(blk);
 	if (!base_addr)
-		return -RT_ERROR;
+		return;
 
 	node = vn_find(base_addr, blk->size, id, size);
-	if (node->id == FVS_END_OF_ID)
-		return -RT_ERROR;
+	if (vn_id(node) == FVS_END_OF_ID)
+		return;
+
+	fvs_verbose("FVS: delete node 0x%p, ", node);
+	fvs_verbose("id: %d, size: %d\n", id, size);
+
+	tomb = vn_find(base_addr, blk->size, FVS_END_OF_ID, (fvs_size_t)-1);
+	/* drop it on rolling if there is no room for the tombstone */
+	if ((rt_uint8_t*)(tomb+1) > base_addr + blk->size) {
+		blk_roll_pages(blk, node, RT_NULL, 0);
+		return;
+	}
+
+	vn_do_create(base_addr, tomb, id, size | FVS_VN_TOMB);
+	vn_mark_written(base_addr, tomb, vn_seq_of_next(base_addr, id, size));
+}
+
+void fvs_vnode_delete(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size)
+{
+	FVS_TRACE(FVS_TRACE_DELETE, id, size);
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov) {
+		struct fvs_gov_slot *slot = gov_slot_of(blk->gov, id, size);
+
+		if (slot)
+			rt_memset(slot, 0, sizeof(*slot));
+	}
+#endif
+	fl_clear_error();
+	vn_delete(blk, id, size);
+}
+
+/* Write data to the existing node whose content is different from data.
+ * created tells whether node is just created by vn_get. */
+static rt_err_t vn_update(
+		const struct fvs_block *blk,
+		rt_uint8_t *base_addr,
+		struct fvs_vnode *node,
+		void *data,
+		rt_bool_t created)
+{
+	struct fvs_vnode *new_node;
+	fvs_id_t id = vn_id(node);
+	fvs_size_t size = vn_size(node);
+	fvs_size_t n, len;
+	fvs_native_t seq;
+
+	new_node = vn_find(base_addr, blk->size, FVS_END_OF_ID, (fvs_size_t)-1);
 
 	/* find the fresh node if possible. */
 	if (vn_is_empty(node)) {
 		fvs_verbose("FVS: first write on node 0x%p, ", node);
 		fvs_verbose("id: %d, size: %d\n", id, size);
 
-		vn_fill_data(base_addr, node, data);
-
+		seq = vn_seq_of_next(base_addr, id, size);
+		/* Fill it in place only if it is just created. An earlier first
+		 * write may be cut after some units of the data, which look erased
+		 * if programmed with all ones, and each unit could be programmed
+		 * only once. */
+		if (created) {
+			vn_fill_data(base_addr, node, data, seq);
+			return RT_EOK;
+		}
+
+		/* write a new record instead */
+		if ((rt_uint8_t*)new_node + vn_rec_len(size) > base_addr + blk->size) {
+			blk_roll_pages(blk, node, data, 0);
+		} else {
+			vn_do_create(base_addr, new_node, id, size);
+			vn_fill_data(base_addr, new_node, data, seq);
+		}
 		return RT_EOK;
 	}
 
-	/* if the content does not change, there is nothing to do. */
-	if (rt_memcmp(node+1, data, size) == 0) {
-		fvs_verbose("FVS: write old data on node 0x%p\n", node);
+	/* append the changed words only if they fit in a patch. The pointed
+	 * vnode is written in full, or the next fvs_vnode_get would have to fold
+	 * the patch with another full copy. */
+	n = vn_diff(base_addr, node, data);
+	len = 2 * vn_patch_pairs(size) * sizeof(fvs_native_t);
+	if (vn_patch_nr(base_addr, node, &seq) < FVS_PATCH_CHAIN_MAX &&
+	    len && n <= vn_patch_pairs(size) && !vn_is_pointed(blk, id, size) &&
+	    (rt_uint8_t*)new_node + vn_rec_len(len) <= base_addr + blk->size) {
+		vn_write_patch(base_addr, new_node, node, data, n, vn_seq_next(seq));
 		return RT_EOK;
 	}
 
-	new_node = vn_find(base_addr, blk->size, FVS_END_OF_ID, (fvs_size_t)-1);
 	/* we need rewrite the whole blk since there is no free node left. The
 	 * other page will be able to contain all the nodes since we have had that
-	 * node in this page. (We will return -RT_ERROR on node not found.) */
-	if ((rt_uint8_t*)(new_node+1) + size > base_addr + blk->size) {
+	 * node in this page. The new data takes the place of the old one on
+	 * rolling so it is never lost. */
+	if ((rt_uint8_t*)new_node + vn_rec_len(size) > base_addr + blk->size) {
 		fvs_verbose("FVS: rewrite whole blk 0x%p, page 0x%p ", blk, base_addr);
 		fvs_verbose("id: %d, size: %d\n", id, size);
 
-		/* delete and write back */
-		fvs_vnode_delete(blk, id, size);
-		blk_roll_pages(blk);
-		new_node = fvs_vnode_get(blk, id, size);
-		ASSERT(new_node);
-		/* fvs_vnode_get return the data address and we need to rewind it */
-		new_node -= 1;
-		vn_fill_data(base_addr, new_node, data);
+		blk_roll_pages(blk, node, data, 0);
 	} else {
 		fvs_verbose("FVS: write to new node:0x%p, old node:0x%p, ",
 				new_node, node);
 		fvs_verbose("id: %d, size: %d\n", id, size);
 
-		/* create the new node before mark the old one as invalid */
+		/* the new node supersedes the old one once it is committed. The old
+		 * one is discarded on rolling. */
 		vn_do_create(base_addr, new_node, id, size);
-		vn_fill_data(base_addr, new_node, data);
-		vn_mark_invalid(base_addr, node);
+		vn_fill_data(base_addr, new_node, data, vn_seq_next(seq));
+	}
+	return RT_EOK;
+}
+
+#ifdef FVS_USING_GOVERNOR
+static struct fvs_gov_slot *gov_slot_of(
+		struct fvs_governor *gov,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	struct fvs_gov_slot *slot;
+
+	for (slot = gov->slots; slot < gov->slots + FVS_GOV_SLOT_NR; slot++) {
+		if (slot->id == id && slot->size == size)
+			return slot;
+	}
+	return RT_NULL;
+}
+
+/* the write counter of (id, size), RT_NULL if it's not counted */
+static struct fvs_gov_id *gov_id_of(
+		struct fvs_governor *gov,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	struct fvs_gov_id *ent;
+
+	for (ent = gov->ids; ent < gov->ids + FVS_GOV_ID_NR; ent++) {
+		if (ent->id == id && ent->size == size)
+			return ent;
+	}
+	return RT_NULL;
+}
+
+/* Find the write counter of (id, size), replace the one with the fewest
+ * writes if there is no such counter. The hot vnodes are kept counted as the
+ * new counter is the first to be replaced. */
+static struct fvs_gov_id *gov_find_id(
+		struct fvs_governor *gov,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	struct fvs_gov_id *ent, *spare = gov->ids;
+
+	ent = gov_id_of(gov, id, size);
+	if (ent)
+		return ent;
+
+	for (ent = gov->ids; ent < gov->ids + FVS_GOV_ID_NR; ent++) {
+		if (ent->id == 0) {
+			spare = ent;
+			break;
+		}
+		if (ent->writes < spare->writes)
+			spare = ent;
+	}
+
+	rt_memset(spare, 0, sizeof(*spare));
+	spare->id = id;
+	spare->size = size;
+	return spare;
+}
+
+/* find the slot of (id, size), allocate one if there is no such slot */
+static struct fvs_gov_slot *gov_find_slot(
+		struct fvs_governor *gov,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	struct fvs_gov_slot *slot, *spare = RT_NULL;
+
+	slot = gov_slot_of(gov, id, size);
+	if (slot || size > FVS_GOV_SLOT_SZ)
+		return slot;
+
+	/* prefer the free slot over the clean one */
+	for (slot = gov->slots; slot < gov->slots + FVS_GOV_SLOT_NR; slot++) {
+		if (slot->id == 0) {
+			spare = slot;
+			break;
+		}
+		if (!slot->dirty && spare == RT_NULL)
+			spare = slot;
+	}
+	if (spare == RT_NULL)
+		return RT_NULL;
+
+	rt_memset(spare, 0, sizeof(*spare));
+	spare->id = id;
+	spare->size = size;
+	return spare;
+}
+
+static rt_bool_t gov_throttled(
+		struct fvs_governor *gov,
+		struct fvs_gov_id *ent)
+{
+	rt_tick_t elapsed = rt_tick_get() - gov->start;
+
+	if (ent && gov->id_budget && ent->writes >= gov->id_budget)
+		return RT_TRUE;
+
+	/* the erases are allowed at the pace of budget per window. */
+	return (uint64_t)gov->erases * gov->window >
+	       (uint64_t)gov->budget * elapsed;
+}
+
+static rt_err_t gov_persist(
+		const struct fvs_block *blk,
+		struct fvs_gov_slot *slot)
+{
+	struct fvs_gov_id *ent;
+	struct fvs_vnode *node;
+	rt_uint8_t *base_addr;
+	rt_bool_t created;
+
+	/* the vnode is created before its writes are coalesced */
+	node = vn_get(blk, slot->id, slot->size, RT_FALSE, &created);
+	if (node == RT_NULL)
+		return -RT_EFULL;
+	base_addr = blk_find_using(blk);
+
+	slot->dirty = RT_FALSE;
+	ent = gov_id_of(blk->gov, slot->id, slot->size);
+	if (ent)
+		ent->writes++;
+
+	fvs_verbose("FVS: persist coalesced id: %d, size: %d\n",
+			slot->id, slot->size);
+
+	if (vn_is_empty(node) || vn_diff(base_addr, node, slot->data) != 0)
+		vn_update(blk, base_addr, node, slot->data, created);
+	/* try it again later if the flash could not be read */
+	if (fl_error() != RT_EOK)
+		slot->dirty = RT_TRUE;
+	return fl_error();
+}
+
+rt_err_t fvs_gov_flush(const struct fvs_block *blk, rt_bool_t force)
+{
+	struct fvs_governor *gov = blk->gov;
+	struct fvs_gov_slot *slot;
+	struct fvs_gov_id *ent;
+	rt_err_t res = RT_EOK;
+
+	if (gov == RT_NULL)
+		return RT_EOK;
+
+	fl_clear_error();
+	/* start a new window */
+	if (rt_tick_get() - gov->start >= gov->window) {
+		gov->start = rt_tick_get();
+		gov->erases = 0;
+		for (ent = gov->ids; ent < gov->ids + FVS_GOV_ID_NR; ent++)
+			ent->writes = 0;
+	}
+
+	for (slot = gov->slots; slot < gov->slots + FVS_GOV_SLOT_NR; slot++) {
+		if (!slot->dirty)
+			continue;
+		if (!force && gov_throttled(gov, gov_id_of(gov, slot->id, slot->size)))
+			continue;
+		if (gov_persist(blk, slot) != RT_EOK)
+			res = -RT_EFULL;
 	}
+	return fl_result(res);
+}
+
+/* The vnode should have been created on flash, so the coalesced data could
+ * always be persisted.
+ *
+ * @return RT_EOK if the write is absorbed by the governor.
+ */
+static rt_err_t gov_write(
+		const struct fvs_block *blk,
+		fvs_id_t id,
+		fvs_size_t size,
+		void *data)
+{
+	struct fvs_governor *gov = blk->gov;
+	struct fvs_gov_slot *slot;
+	struct fvs_gov_id *ent;
+
+	slot = gov_slot_of(gov, id, size);
+	if (slot && slot->dirty && rt_memcmp(slot->data, data, size) == 0) {
+		FVS_TRACE(FVS_TRACE_WRITE_SAME, id, size);
+		return RT_EOK;
+	}
+
+	ent = gov_find_id(gov, id, size);
+	if (!gov_throttled(gov, ent)) {
+		ent->writes++;
+		return -RT_EBUSY;
+	}
+
+	/* the slot is taken only when the write is throttled */
+	if (slot == RT_NULL)
+		slot = gov_find_slot(gov, id, size);
+	if (slot == RT_NULL) {
+		/* no room to coalesce, have to write through */
+		gov->overflow++;
+		ent->writes++;
+		return -RT_EBUSY;
+	}
+
+	FVS_TRACE(FVS_TRACE_WRITE, id, size);
+	fvs_verbose("FVS: coalesce id: %d, size: %d\n", id, size);
+
+	rt_memcpy(slot->data, data, size);
+	slot->dirty = RT_TRUE;
+	ent->coalesced++;
 	return RT_EOK;
 }
 
+/* the data written to flash supersedes the coalesced one */
+static void gov_written(
+		const struct fvs_block *blk,
+		fvs_id_t id,
+		fvs_size_t size)
+{
+	struct fvs_gov_slot *slot = gov_slot_of(blk->gov, id, size);
+
+	if (slot)
+		slot->dirty = RT_FALSE;
+}
+
+void fvs_gov_dump(const struct fvs_block *blk)
+{
+	struct fvs_governor *gov = blk->gov;
+	struct fvs_gov_slot *slot;
+	struct fvs_gov_id *ent;
+
+	if (gov == RT_NULL)
+		return;
+
+	rt_kprintf("FVS: blk 0x%p %d/%d erases in window, %s, %d overflow\n",
+			(void*)blk, gov->erases, gov->budget,
+			gov_throttled(gov, RT_NULL) ? "throttled" : "normal",
+			gov->overflow);
+	for (ent = gov->ids; ent < gov->ids + FVS_GOV_ID_NR; ent++) {
+		if (ent->id == 0)
+			continue;
+		slot = gov_slot_of(gov, ent->id, ent->size);
+		rt_kprintf("  id: %d, size: %d, writes: %d, coalesced: %d%s\n",
+				ent->id, ent->size, ent->writes, ent->coalesced,
+				slot && slot->dirty ? ", pending" : "");
+	}
+}
+#endif
+
+rt_err_t fvs_vnode_write(const struct fvs_block *blk, fvs_id_t id, fvs_size_t size, void *data)
+{
+	struct fvs_vnode *node;
+	rt_uint8_t *base_addr;
+	rt_err_t res = RT_EOK;
+	rt_bool_t created;
+
+	ASSERT(blk);
+	ASSERT(id != FVS_END_OF_ID);
+
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov)
+		fvs_gov_flush(blk, RT_FALSE);
+#endif
+	fl_clear_error();
+
+	/* the vnode is created on the first write, even if the data is
+	 * coalesced, so there is always room to persist it */
+	node = vn_get(blk, id, size, RT_FALSE, &created);
+	if (node == RT_NULL)
+		return fl_result(-RT_EFULL);
+#ifdef FVS_USING_GOVERNOR
+	if (blk->gov && gov_write(blk, id, size, data) == RT_EOK)
+		return fl_result(RT_EOK);
+#endif
+	base_addr = blk_find_using(blk);
+
+	/* if the content does not change, there is nothing to do. */
+	if (!vn_is_empty(node) && vn_diff(base_addr, node, data) == 0) {
+		FVS_TRACE(FVS_TRACE_WRITE_SAME, id, size);
+		fvs_verbose("FVS: write old data on node 0x%p\n", node);
+	} else {
+		FVS_TRACE(FVS_TRACE_WRITE, id, size);
+		res = vn_update(blk, base_addr, node, data, created);
+	}
+
+	res = fl_result(res);
+#ifdef FVS_USING_GOVERNOR
+	/* the coalesced data is kept if the new one is not written */
+	if (blk->gov && res == RT_EOK)
+		gov_written(blk, id, size);
+#endif
+	return res;
+}
@@ -45,33 +45,168 @@
 
 #include "fvs_hal.h"
 
+#ifdef FVS_HAL_NO_MMAP
+/* The flash is not memory mapped. FVS reads it through a cache of
+ * FVS_CACHE_LINE_NR lines of FVS_CACHE_LINE_SZ bytes. The line size should be
+ * power of 2. */
+#ifndef FVS_CACHE_LINE_SZ
+#define FVS_CACHE_LINE_SZ 128
+#endif
+#ifndef FVS_CACHE_LINE_NR
+#define FVS_CACHE_LINE_NR 2
+#endif
+#endif
+
+/* The flash is programmed in units of FVS_PROG_UNIT bytes and each unit could
+ * be programmed only once, like the flash with ECC. It could be defined in
+ * fvs/hw.h, it should be power of 2 and multiple of fvs_native_t. */
+#ifndef FVS_PROG_UNIT
+#define FVS_PROG_UNIT sizeof(fvs_native_t)
+#endif
+
 typedef fvs_native_t fvs_id_t;
 typedef fvs_native_t fvs_size_t;
 
 /** the values after erase */
 #define FVS_END_OF_ID  ((fvs_id_t)(-1))
 
+/* When only a few words of a vnode are changed, the changed words are appended
+ * as a patch instead of a full copy. A full copy is written again after this
+ * number of patches. */
+#ifndef FVS_PATCH_CHAIN_MAX
+#define FVS_PATCH_CHAIN_MAX 4
+#endif
+/* the max number of changed words in a patch. Each patch takes room for this
+ * number of words and their indexes even if fewer words are changed. */
+#ifndef FVS_PATCH_PAIR_NR
+#define FVS_PATCH_PAIR_NR 2
+#endif
+#ifndef FVS_HAL_NO_MMAP
+/* number of vnodes remembered to be pointed by fvs_vnode_get. They are always
+ * written as full copies since a patch on them would be folded into another
+ * full copy by the next fvs_vnode_get. */
+#ifndef FVS_POINTED_NR
+#define FVS_POINTED_NR 4
+#endif
+#endif
+
+/* The vnodes are sorted by (id, size) on rolling. If there are this number of
+ * vnodes at least, a directory of them is written so they could be binary
+ * searched. It takes one fvs_native_t for each vnode. */
+#ifndef FVS_DIR_MIN_NR
+#define FVS_DIR_MIN_NR 8
+#endif
+
 /* number of physical page involved with page rolling.
  * Due to implementation details, this is not configurable. I just use micro to
  * avoid magic numbers.
  */
 #define FVS_BLK_PAGE_NR 2
 
+#ifdef FVS_USING_GOVERNOR
+/* number of vnodes could be coalesced in RAM when the block is throttled */
+#ifndef FVS_GOV_SLOT_NR
+#define FVS_GOV_SLOT_NR 4
+#endif
+/* the max size of the vnode could be coalesced */
+#ifndef FVS_GOV_SLOT_SZ
+#define FVS_GOV_SLOT_SZ 32
+#endif
+/* number of vnodes whose writes are counted, the one with the fewest writes
+ * is replaced when it's full */
+#ifndef FVS_GOV_ID_NR
+#define FVS_GOV_ID_NR 8
+#endif
+
+struct fvs_gov_id {
+	/* 0 for free entry */
+	fvs_id_t id;
+	fvs_size_t size;
+	/* number of flash writes in current window */
+	rt_uint32_t writes;
+	/* number of writes held back in RAM */
+	rt_uint32_t coalesced;
+};
+
+struct fvs_gov_slot {
+	/* 0 for free slot */
+	fvs_id_t id;
+	fvs_size_t size;
+	/* whether the data is newer than the one on flash */
+	rt_bool_t dirty;
+	fvs_native_t data[FVS_GOV_SLOT_SZ / sizeof(fvs_native_t)];
+};
+
+/* The endurance governor of a block. The block is allowed to be erased budget
+ * times per window ticks. When the block erases faster than that, writes with
+ * new data are held in RAM and persisted when the erasing pace falls back
+ * under the budget. */
+struct fvs_governor {
+	rt_uint32_t budget;
+	rt_tick_t window;
+	/* the max flash writes of each vnode per window, 0 for no limit */
+	rt_uint32_t id_budget;
+
+	rt_tick_t start;
+	/* number of erases in current window */
+	rt_uint32_t erases;
+	/* number of writes gone to flash when being throttled */
+	rt_uint32_t overflow;
+	struct fvs_gov_id ids[FVS_GOV_ID_NR];
+	/* the slots are taken only when the writes are throttled */
+	struct fvs_gov_slot slots[FVS_GOV_SLOT_NR];
+};
+
+#define FVS_GOVERNOR_INIT(budget, window, id_budget) \
+	{(budget), (window), (id_budget)}
+#endif
+
 struct fvs_block {
 	rt_uint8_t *pages[FVS_BLK_PAGE_NR];
 	/* the usable size of the page. This is smaller than the actual size of the
 	 * page. */
 	size_t size;
+#ifdef FVS_USING_GOVERNOR
+	struct fvs_governor *gov;
+#endif
 	// TODO: lock the page, maybe read-write lock is good.
 };
 
 #define FVS_DEFINE_BLOCK(name, base1, base2, size) \
+	_FVS_DEFINE_BLOCK(name, base1, base2, size, RT_NULL)
+
+#define _FVS_DEFINE_BLOCK(name, base1, base2, size, gov) \
 	struct fvs_block name = {(rt_uint8_t*)base1, (rt_uint8_t*)base2,  \
 		/* FVS assume we are in a memory space filled with 0xFF. So we have to
 		 * preserve one information block to hold at least the FVS_END_OF_ID.
-		 * The last fvs_native_t of the page is used to store the page
+		 * The status field of that block is used to store the page
 		 * status(empty(-1) or using(0)). */ \
-		(size_t)size - sizeof(struct fvs_vnode)}
+		(size_t)size - sizeof(struct fvs_vnode) _FVS_BLK_GOV(gov)}
+
+#ifdef FVS_USING_GOVERNOR
+#define _FVS_BLK_GOV(gov) , gov
+
+/* define a block whose flash endurance is protected by the governor gov */
+#define FVS_DEFINE_GOVERNED_BLOCK(name, base1, base2, size, gov) \
+	_FVS_DEFINE_BLOCK(name, base1, base2, size, gov)
+#else
+#define _FVS_BLK_GOV(gov)
+#endif
+
+/* bytes to pad sz to the program unit */
+#define _FVS_UNIT_PAD(sz) \
+	((FVS_PROG_UNIT - (sz) % FVS_PROG_UNIT) % FVS_PROG_UNIT)
+
+/* The status is programmed later than (id, size), so it's in its own program
+ * unit. The offset is computed so there is no zero sized padding. */
+#define _FVS_VN_STATUS_IDX \
+	(_FVS_UNIT_PAD(2 * sizeof(fvs_native_t)) / sizeof(fvs_native_t))
+#define _FVS_VN_STATUS_NR (_FVS_VN_STATUS_IDX + \
+	(sizeof(fvs_native_t) + _FVS_UNIT_PAD(sizeof(fvs_native_t))) / \
+	sizeof(fvs_native_t))
+
+/* the status of a fvs_vnode */
+#define FVS_VN_STATUS(node) ((node)->status[_FVS_VN_STATUS_IDX])
 
 /* the struct is reside on the flash in most of the times. The content of
  * base_addr of a fvs_block should a fvs_vnode. */
@@ -80,8 +215,11 @@ struct fvs_vnode {
 	fvs_id_t id;
 	/* the size of variable(without this head struct) */
 	fvs_size_t size;
-	fvs_native_t status;
-	/* there should be size of bytes of data followed */
+	/* all ones before the data is written, then the sequence number. Access
+	 * it by FVS_VN_STATUS, the rest is the padding to the program unit */
+	fvs_native_t status[_FVS_VN_STATUS_NR];
+	/* there should be size of bytes of data followed, padded to the program
+	 * unit */
 } __attribute__((packed));
 
 /** return how many byte are used in the page.
@@ -92,25 +230,128 @@ size_t fvs_page_used_size(const struct fvs_block *page);
 
 /** return whether the page is used
  *
- * A used page is a page that we have created(get) vnode on.
+ * A used page is a page that we have created(get or write) vnode on.
  */
 rt_bool_t fvs_page_used(const struct fvs_block *page);
 
 
+#ifndef FVS_HAL_NO_MMAP
 /** get vnode (id, size) from page
+ *
+ * The last FVS_POINTED_NR vnodes got are written as full copies by
+ * fvs_vnode_write. If the vnode has been updated by patches otherwise, the
+ * patched value will be written as a full copy so it could be pointed, which
+ * costs one more record. Use fvs_vnode_read to avoid that.
  *
  * @return the pointer to the data. You can cast the pointer to the pointer
  * type of your real variable.
  */
 void *fvs_vnode_get(const struct fvs_block *page, fvs_id_t id, size_t size);
+#endif
+
+/** the copy-out variant of fvs_vnode_get
+ *
+ * Unlike fvs_vnode_get, it never writes the flash. The absent vnode is not
+ * created, buf is filled with 0xFF as the erased data instead.
+ *
+ * @return -RT_EIO if the flash could not be read.
+ */
+rt_err_t fvs_vnode_get_copy(const struct fvs_block *page, fvs_id_t id, fvs_size_t size, void *buf);
+
+#ifdef FVS_HAL_NO_MMAP
+/** drop the cached flash content
+ *
+ * It should be called if the flash is changed without FVS.
+ */
+void fvs_cache_invalidate(void);
+#endif
+
+/** return whether the vnode (id, size) on page has been written
+ *
+ * Unlike fvs_vnode_get, it never writes the flash.
+ *
+ * @return -RT_EEMPTY if the vnode is absent, -RT_EIO if the flash could not
+ * be read.
+ */
+rt_err_t fvs_vnode_peek(const struct fvs_block *page, fvs_id_t id, fvs_size_t size);
+
+/** copy the data of vnode (id, size) on page to buf
+ *
+ * Unlike fvs_vnode_get, it never writes the flash.
+ *
+ * @return -RT_EEMPTY if the vnode is absent, buf is left untouched. -RT_EIO
+ * if the flash could not be read.
+ */
+rt_err_t fvs_vnode_read(const struct fvs_block *page, fvs_id_t id, fvs_size_t size, void *buf);
 
 /** update the the vnode (id, size) on page with the data pointed by data
  *
- * @return the error code on write failure.
+ * The vnode is created if it's absent.
+ *
+ * @return -RT_EFULL if there is no room to create the vnode, -RT_EIO if the
+ * flash could not be read, nothing is written then.
  */
 rt_err_t fvs_vnode_write(const struct fvs_block *page, fvs_id_t id, fvs_size_t size, void *data);
 
 /** delete the vnode (id, size) on page */
 void fvs_vnode_delete(const struct fvs_block *page, fvs_id_t id, fvs_size_t size);
 
+#ifdef FVS_USING_GOVERNOR
+/** persist the data coalesced by the governor of the block
+ *
+ * It should be called periodically, the data is persisted only when the
+ * block is not throttled unless force is RT_TRUE. Call it with force before
+ * power off.
+ *
+ * @return -RT_EFULL if some data could not be persisted, it is kept in RAM
+ * and tried again on the next flush. -RT_EIO if the flash could not be read.
+ */
+rt_err_t fvs_gov_flush(const struct fvs_block *blk, rt_bool_t force);
+
+/** print the governor status and the throttled vnodes of the block */
+void fvs_gov_dump(const struct fvs_block *blk);
+#endif
+
+/* the operations in trace, also used by fvs_replay */
+enum fvs_trace_op {
+	FVS_TRACE_GET        = 'G',
+	FVS_TRACE_WRITE      = 'W',
+	/* write with the same content as the one on flash */
+	FVS_TRACE_WRITE_SAME = 'S',
+	FVS_TRACE_DELETE     = 'D',
+};
+
+#ifdef FVS_USING_TRACE
+/* number of events could be hold in the trace ring buffer. It should be power
+ * of 2. The oldest events will be overwritten when the buffer is full. */
+#ifndef FVS_TRACE_NR
+#define FVS_TRACE_NR 64
+#endif
+
+struct fvs_trace_event {
+	rt_tick_t tick;
+	fvs_id_t id;
+	fvs_size_t size;
+	rt_uint8_t op;
+};
+
+/** fetch at most nr events from the trace buffer, the oldest first
+ *
+ * The events fetched are removed from the buffer.
+ *
+ * @return the number of events fetched.
+ */
+rt_size_t fvs_trace_read(struct fvs_trace_event *buf, rt_size_t nr);
+
+/** return the number of events overwritten before being read and reset it */
+rt_uint32_t fvs_trace_lost(void);
+
+/** print and remove all the events in the trace buffer
+ *
+ * Each event is printed as a line of "FVS-T tick op id size", which could be
+ * fed to fvs_replay.
+ */
+void fvs_trace_dump(void);
+#endif
+
 #endif /* end of include guard: FVS_H */
@@ -14,5 +14,9 @@ rt_err_t fvs_native_write_m(void* addr, rt_uint8_t *data, rt_size_t len);
 rt_err_t fvs_native_write_r(void* addr, fvs_native_t data);
 rt_err_t fvs_end_write(void *base_addr);
 rt_err_t fvs_erase_page(void *base_addr);
+#ifdef FVS_HAL_NO_MMAP
+/* read the flash which is not memory mapped */
+rt_err_t fvs_read(void *addr, void *buf, rt_size_t len);
+#endif
 
 #endif /* end of include guard: __FVS_HAL_H_ */
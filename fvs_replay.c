@@ -0,0 +1,183 @@
+/** Flash Variable System
+ *
+ * Trace replay. This is part of FVS project
+ *
+ * Replay the trace printed by fvs_trace_dump on the simulated flash(hal/sim)
+ * and project the flash life time from it. Every line not starting with
+ * "FVS-T" is ignored, so the raw console log could be used directly.
+ *
+ * All the vnodes in the trace are put into one block of blk_sz bytes, so
+ * different block sizes could be compared with the same trace.
+ *
+ * The trace does not record the content, so each write is replayed as a change
+ * of one word, which is appended as a patch when possible. The real writes
+ * changing more words, and the writes of the vnodes pointed by fvs_vnode_get,
+ * are full copies, so the projection is optimistic for them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <rtthread.h>
+
+#include "fvs.h"
+
+#define _MAX_DATA_SZ 256
+/* number of the slowest operations to report */
+#define _OUTLIER_NR  8
+
+struct _op_lat {
+	rt_uint32_t line;
+	rt_uint32_t us;
+	char op;
+	fvs_id_t id;
+	fvs_size_t size;
+};
+
+static fvs_native_t _data[_MAX_DATA_SZ / sizeof(fvs_native_t)];
+
+static void _record_slowest(struct _op_lat *slow, const struct _op_lat *lat)
+{
+	int i;
+
+	if (lat->us <= slow[_OUTLIER_NR-1].us)
+		return;
+
+	for (i = _OUTLIER_NR-1; i > 0 && slow[i-1].us < lat->us; i--)
+		slow[i] = slow[i-1];
+	slow[i] = *lat;
+}
+
+static rt_err_t _replay_op(const struct fvs_block *blk,
+		char op, fvs_id_t id, fvs_size_t size)
+{
+	if (op == FVS_TRACE_DELETE) {
+		fvs_vnode_delete(blk, id, size);
+		return RT_EOK;
+	}
+
+	if (fvs_vnode_read(blk, id, size, _data) != RT_EOK)
+		rt_memset(_data, 0xFF, size);
+	if (op == FVS_TRACE_GET)
+		return RT_EOK;
+
+	/* the real content is unknown, change one word to make a real update */
+	if (op == FVS_TRACE_WRITE)
+		_data[0]--;
+	return fvs_vnode_write(blk, id, size, _data);
+}
+
+int fvs_replay(const char *path, rt_size_t blk_sz)
+{
+	FILE *fp;
+	char line[128];
+	rt_uint32_t lineno = 0, op_nr = 0, skip_nr = 0, fail_nr = 0;
+	rt_uint32_t user_bytes = 0, total_us = 0, outlier_nr = 0;
+	rt_tick_t last_tick = 0;
+	double ticks = 0, days;
+	struct _op_lat slow[_OUTLIER_NR];
+	int i;
+
+	const FVS_DEFINE_BLOCK(blk, FVS_SIM_PAGE(0), FVS_SIM_PAGE(1), blk_sz);
+
+	if (blk_sz == 0 || blk_sz > FVS_SIM_PAGE_SZ) {
+		printf("block size should be in (0, %d]\n", FVS_SIM_PAGE_SZ);
+		return -RT_ERROR;
+	}
+	/* the page status is put at the end of the block */
+	if (blk_sz % FVS_PROG_UNIT) {
+		printf("block size should be multiple of %d\n", (int)FVS_PROG_UNIT);
+		return -RT_ERROR;
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("can not open %s\n", path);
+		return -RT_EIO;
+	}
+
+	fvs_sim_reset();
+	memset(slow, 0, sizeof(slow));
+
+	while (fgets(line, sizeof(line), fp)) {
+		struct _op_lat lat;
+		unsigned long tick, id, size;
+		rt_uint32_t start;
+		char *s;
+
+		lineno++;
+		s = strstr(line, "FVS-T ");
+		if (s == NULL)
+			continue;
+		if (sscanf(s, "FVS-T %lu %c %lu %lu", &tick, &lat.op, &id, &size) != 4)
+			continue;
+
+		if (id == 0 || (fvs_id_t)id == FVS_END_OF_ID ||
+		    size > _MAX_DATA_SZ || size % sizeof(fvs_native_t)) {
+			skip_nr++;
+			continue;
+		}
+		/* tolerate the tick counter overflow */
+		if (op_nr)
+			ticks += (rt_tick_t)((rt_tick_t)tick - last_tick);
+		last_tick = tick;
+
+		start = fvs_sim_stat.time_us;
+		if (_replay_op(&blk, lat.op, id, size) != RT_EOK)
+			fail_nr++;
+		if (lat.op == FVS_TRACE_WRITE)
+			user_bytes += size;
+
+		lat.line = lineno;
+		lat.us   = fvs_sim_stat.time_us - start;
+		lat.id   = id;
+		lat.size = size;
+		total_us += lat.us;
+		/* the ones have to wait for a page erasing */
+		if (lat.us >= FVS_SIM_ERASE_US)
+			outlier_nr++;
+		_record_slowest(slow, &lat);
+		op_nr++;
+	}
+	fclose(fp);
+
+	if (op_nr == 0) {
+		printf("no trace event found in %s\n", path);
+		return -RT_ERROR;
+	}
+
+	printf("replayed %u operations on %u bytes block, %u skipped, %u failed\n",
+			op_nr, (unsigned)blk_sz, skip_nr, fail_nr);
+	printf("each write replayed as one word changed, the projection is optimistic\n");
+
+	days = ticks / RT_TICK_PER_SECOND / (24 * 3600);
+	for (i = 0; i < FVS_BLK_PAGE_NR; i++) {
+		if (days > 0)
+			printf("page %d: %u erases, %.3f erases per day\n",
+					i, fvs_sim_stat.erase_nr[i],
+					fvs_sim_stat.erase_nr[i] / days);
+		else
+			printf("page %d: %u erases\n", i, fvs_sim_stat.erase_nr[i]);
+	}
+
+	if (user_bytes)
+		printf("write amplification: %.2f (%u bytes programmed, %u bytes written)\n",
+				(double)fvs_sim_stat.prog_bytes / user_bytes,
+				fvs_sim_stat.prog_bytes, user_bytes);
+
+	if (fvs_sim_stat.read_nr)
+		printf("read: %u transactions, %u bytes\n",
+				fvs_sim_stat.read_nr, fvs_sim_stat.read_bytes);
+
+	printf("latency: mean %.1f us, %u operations waited for erasing\n",
+			(double)total_us / op_nr, outlier_nr);
+	for (i = 0; i < _OUTLIER_NR && slow[i].us; i++)
+		printf("  line %u: %c id %u size %u took %u us\n",
+				slow[i].line, slow[i].op, slow[i].id, slow[i].size, slow[i].us);
+
+	return RT_EOK;
+}
+
+#ifdef RT_USING_FINSH
+#include <finsh.h>
+FINSH_FUNCTION_EXPORT(fvs_replay, replay fvs trace on the simulated flash);
+#endif
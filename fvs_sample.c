@@ -19,9 +19,9 @@ uint16_t user_input;
 
 void init(void)
 {
-	boot_time = *(uint32_t*)fvs_vnode_get(&the_page,
-			                      BOOT_TIME_ID, sizeof(boot_time));
-	if (boot_time == 0xFFFF) {
+	/* the vnode is created by the first write */
+	if (fvs_vnode_read(&the_page, BOOT_TIME_ID,
+			   sizeof(boot_time), &boot_time) != RT_EOK) {
 		boot_time = 1;
 	} else {
 		boot_time++;
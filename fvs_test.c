@@ -7,11 +7,16 @@
 
 #include "fvs.h"
 
-// don't need the whole physical page, 128 bytes should be enough to go
-#define _PAGE_SZ 128
+// don't need the whole physical page, 128 bytes should be enough to go. The
+// records take more space on the flash with wider program unit.
+#define _PAGE_SZ (FVS_PROG_UNIT > 4 ? 32 * FVS_PROG_UNIT : 128)
+
+/* the data is padded to the program unit */
+#define _UNIT_ALIGN(sz) \
+	(((sz) + FVS_PROG_UNIT - 1) / FVS_PROG_UNIT * FVS_PROG_UNIT)
 
 #define _DATA_SZ 4
-#define _NODE_SZ (sizeof(struct fvs_vnode)+_DATA_SZ)
+#define _NODE_SZ (sizeof(struct fvs_vnode)+_UNIT_ALIGN(_DATA_SZ))
 #define _NODE_PER_PAGE ((_PAGE_SZ+_NODE_SZ/2)/_NODE_SZ-1)
 
 #define _RETURN_ON_FAIL(exp) \
@@ -21,6 +26,7 @@
 		return res; \
 	} while (0)
 
+#ifndef FVS_HAL_NO_MMAP
 static rt_err_t _test_vnode_get(const struct fvs_block *pg)
 {
 	int i;
@@ -143,11 +149,548 @@ static rt_err_t _test_del(const struct fvs_block *pg)
 		return -RT_EOK;
 	}
 }
+#endif
+
+static void _reset_block(const struct fvs_block *pg)
+{
+	int i;
+
+	for (i = 0; i < FVS_BLK_PAGE_NR; i++)
+	{
+		fvs_begin_write((void*)pg->pages[i]);
+		fvs_erase_page((void*)pg->pages[i]);
+		fvs_end_write((void*)pg->pages[i]);
+	}
+#ifdef FVS_HAL_NO_MMAP
+	fvs_cache_invalidate();
+#endif
+}
+
+static rt_err_t _test_copy(const struct fvs_block *pg)
+{
+	int i, v;
+#ifdef FVS_SIM_SPI_NOR
+	rt_uint32_t nr;
+#endif
+
+	_reset_block(pg);
+
+	for (i = 1; i <= _NODE_PER_PAGE / 2; i++) {
+		if (fvs_vnode_get_copy(pg, i, _DATA_SZ, &v) != RT_EOK || v != -1) {
+			rt_kprintf("fvs get copy fail on i = %d\n", i);
+			return -RT_ERROR;
+		}
+		/* the absent vnode is not created */
+		if (i == 1 && fvs_page_used(pg)) {
+			rt_kprintf("fvs get copy write the flash\n");
+			return -RT_ERROR;
+		}
+		v = i * 3;
+		fvs_vnode_write(pg, i, _DATA_SZ, &v);
+	}
+
+#ifdef FVS_SIM_SPI_NOR
+	nr = fvs_sim_stat.read_nr;
+#endif
+	for (i = 1; i <= _NODE_PER_PAGE / 2; i++) {
+		if (fvs_vnode_read(pg, i, _DATA_SZ, &v) != RT_EOK || v != i * 3) {
+			rt_kprintf("fvs read copy fail on i = %d\n", i);
+			rt_kprintf("expect %d, get %d\n", i * 3, v);
+			return -RT_ERROR;
+		}
+	}
+#ifdef FVS_SIM_SPI_NOR
+	/* the page should be read only once if it could be cached in the lines */
+	if (_PAGE_SZ <= FVS_CACHE_LINE_SZ * FVS_CACHE_LINE_NR &&
+	    fvs_sim_stat.read_nr - nr > _PAGE_SZ / FVS_CACHE_LINE_SZ + 1) {
+		rt_kprintf("fvs read cache fail\n");
+		rt_kprintf("expect %d transactions, get %d\n",
+				_PAGE_SZ / FVS_CACHE_LINE_SZ + 1,
+				fvs_sim_stat.read_nr - nr);
+		return -RT_ERROR;
+	}
+#endif
+
+	rt_kprintf("fvs copy pass\n");
+	return RT_EOK;
+}
+
+static rt_err_t _test_peek(const struct fvs_block *pg)
+{
+	int v = 5;
+
+	_reset_block(pg);
+
+	if (fvs_vnode_peek(pg, 1, _DATA_SZ) != -RT_EEMPTY ||
+	    fvs_vnode_read(pg, 1, _DATA_SZ, &v) != -RT_EEMPTY || v != 5) {
+		rt_kprintf("fvs peek absent vnode fail\n");
+		return -RT_ERROR;
+	}
+	/* the lookup should not touch the flash */
+	if (fvs_page_used(pg)) {
+		rt_kprintf("fvs peek write the flash\n");
+		return -RT_ERROR;
+	}
+
+	if (fvs_vnode_write(pg, 1, _DATA_SZ, &v) != RT_EOK ||
+	    fvs_vnode_peek(pg, 1, _DATA_SZ) != RT_EOK ||
+	    fvs_vnode_peek(pg, 2, _DATA_SZ) != -RT_EEMPTY) {
+		rt_kprintf("fvs write absent vnode fail\n");
+		return -RT_ERROR;
+	}
+	v = 0;
+	if (fvs_vnode_read(pg, 1, _DATA_SZ, &v) != RT_EOK || v != 5) {
+		rt_kprintf("fvs read after write fail\n");
+		rt_kprintf("expect %d, get %d\n", 5, v);
+		return -RT_ERROR;
+	}
+
+	fvs_vnode_delete(pg, 1, _DATA_SZ);
+	if (fvs_vnode_peek(pg, 1, _DATA_SZ) != -RT_EEMPTY) {
+		rt_kprintf("fvs peek deleted vnode fail\n");
+		return -RT_ERROR;
+	}
+
+	rt_kprintf("fvs peek pass\n");
+	return RT_EOK;
+}
+
+#ifdef FVS_SIM_PAGE
+static rt_err_t _test_prog_unit(const struct fvs_block *pg)
+{
+	int v[8], r[8], i;
+	rt_uint8_t *d;
+	rt_uint32_t fail = fvs_sim_stat.prog_fail;
+
+	_reset_block(pg);
+
+	for (i = 0; i < 8; i++)
+		v[i] = i;
+	/* go through the full copies, the patches, the tombstones and rolling */
+	for (i = 0; i < 4 * _NODE_PER_PAGE; i++) {
+		v[i % 8] = i;
+		fvs_vnode_write(pg, 1 + i % 2, sizeof(v), v);
+		fvs_vnode_write(pg, 3, _DATA_SZ, &i);
+		if (i % 5 == 0)
+			fvs_vnode_delete(pg, 3, _DATA_SZ);
+	}
+
+	if (fvs_vnode_read(pg, 1 + (i - 1) % 2, sizeof(v), r) != RT_EOK ||
+	    rt_memcmp(r, v, sizeof(v)) != 0) {
+		rt_kprintf("fvs program unit read fail\n");
+		return -RT_ERROR;
+	}
+
+	/* a first write cut by power loss after the first unit of data, which
+	 * looks erased if it is programmed with all ones */
+	for (i = 0; i < 2; i++) {
+		struct fvs_vnode h;
+
+		_reset_block(pg);
+		rt_memset(&h, 0xFF, sizeof(h));
+		h.id = 1;
+		h.size = sizeof(v);
+		d = (rt_uint8_t*)pg->pages[0];
+		fvs_begin_write(d);
+		fvs_native_write_m(d, (rt_uint8_t*)&h,
+				(rt_uint8_t*)&FVS_VN_STATUS(&h) - (rt_uint8_t*)&h);
+		rt_memset(r, 0xFF, sizeof(r));
+		fvs_native_write_m(d + sizeof(h), i ? (rt_uint8_t*)r : (rt_uint8_t*)v,
+				FVS_PROG_UNIT);
+		fvs_end_write(d);
+#ifdef FVS_HAL_NO_MMAP
+		fvs_cache_invalidate();
+#endif
+		v[0] = 42 + i;
+		v[1] = 43 + i;
+		fvs_vnode_write(pg, 1, sizeof(v), v);
+		if (fvs_vnode_read(pg, 1, sizeof(v), r) != RT_EOK ||
+		    rt_memcmp(r, v, sizeof(v)) != 0) {
+			rt_kprintf("fvs program unit write after power loss fail\n");
+			rt_kprintf("expect %d, get %d\n", v[0], r[0]);
+			return -RT_ERROR;
+		}
+	}
+	/* each unit should be programmed once in whole */
+	if (fvs_sim_stat.prog_fail != fail) {
+		rt_kprintf("fvs program unit fail\n");
+		rt_kprintf("expect no failure, get %d\n", fvs_sim_stat.prog_fail - fail);
+		return -RT_ERROR;
+	}
+
+	rt_kprintf("fvs program unit pass\n");
+	return RT_EOK;
+}
+#endif
+
+#ifdef FVS_SIM_SPI_NOR
+static rt_err_t _test_read_fail(const struct fvs_block *pg)
+{
+	int v[8], o[8], r[8], i;
+	rt_err_t err;
+
+	_reset_block(pg);
+
+	for (i = 0; i < 8; i++)
+		v[i] = i;
+	fvs_vnode_write(pg, 1, sizeof(v), v);
+
+	fvs_cache_invalidate();
+	fvs_sim_read_fail_at = fvs_sim_stat.read_nr + 1;
+	err = fvs_vnode_read(pg, 1, sizeof(v), r);
+	fvs_sim_read_fail_at = 0;
+	if (err != -RT_EIO) {
+		rt_kprintf("fvs read error fail\n");
+		rt_kprintf("expect %d, get %d\n", -RT_EIO, err);
+		return -RT_ERROR;
+	}
+
+	/* the reads fail in the middle of the writes and rolling. The vnode
+	 * should be either the old or the new value, like on power loss. */
+	for (i = 0; i < 4 * _NODE_PER_PAGE; i++) {
+		rt_memcpy(o, v, sizeof(v));
+		v[i % 8] = 0x100 + i;
+
+		fvs_cache_invalidate();
+		fvs_sim_read_fail_at = fvs_sim_stat.read_nr + 1 + i % 8;
+		err = fvs_vnode_write(pg, 1, sizeof(v), v);
+		fvs_sim_read_fail_at = 0;
+
+		fvs_cache_invalidate();
+		if ((err != RT_EOK && err != -RT_EIO) ||
+		    fvs_vnode_read(pg, 1, sizeof(v), r) != RT_EOK ||
+		    (rt_memcmp(r, v, sizeof(v)) != 0 &&
+		     (err == RT_EOK || rt_memcmp(r, o, sizeof(o)) != 0))) {
+			rt_kprintf("fvs write on read error fail on i = %d\n", i);
+			rt_kprintf("get %d, word %d is 0x%X\n", err, i % 8, r[i % 8]);
+			return -RT_ERROR;
+		}
+		rt_memcpy(v, r, sizeof(v));
+	}
+
+	rt_kprintf("fvs read error pass\n");
+	return RT_EOK;
+}
+#endif
+
+#ifndef FVS_HAL_NO_MMAP
+static rt_err_t _test_seq(const struct fvs_block *pg)
+{
+	int i, *p, *op;
+
+	_reset_block(pg);
+
+	op = fvs_vnode_get(pg, 1, _DATA_SZ);
+	for (i = 1; i <= 2; i++)
+		fvs_vnode_write(pg, 1, _DATA_SZ, &i);
+
+	p = fvs_vnode_get(pg, 1, _DATA_SZ);
+	/* the old record is left as it was. The one created by get is not
+	 * filled, as the data of a cut write could look erased. */
+	if (*p != 2 || *op != -1 || ((struct fvs_vnode*)op-1)->id != 1) {
+		rt_kprintf("fvs sequence write fail\n");
+		rt_kprintf("expect 2 and old -1, get %d and old %d\n", *p, *op);
+		return -RT_ERROR;
+	}
+
+	fvs_vnode_delete(pg, 1, _DATA_SZ);
+	p = fvs_vnode_get(pg, 1, _DATA_SZ);
+	if (*p != -1) {
+		rt_kprintf("fvs sequence delete fail\n");
+		rt_kprintf("expect 0x%X, get 0x%X\n", -1, *p);
+		return -RT_ERROR;
+	}
+
+	i = 3;
+	fvs_vnode_write(pg, 1, _DATA_SZ, &i);
+	if (*(int*)fvs_vnode_get(pg, 1, _DATA_SZ) != 3) {
+		rt_kprintf("fvs sequence write after delete fail\n");
+		return -RT_ERROR;
+	}
+
+	rt_kprintf("fvs sequence pass\n");
+	return RT_EOK;
+}
+
+static rt_err_t _test_dir(const struct fvs_block *pg)
+{
+	struct fvs_block dpg = *pg;
+	struct fvs_vnode *node;
+	fvs_native_t *ent;
+	int i, v, w, nr = 2 * FVS_DIR_MIN_NR;
+
+	/* a larger page to hold enough vnodes for the directory */
+	dpg.size = 4 * _PAGE_SZ - sizeof(struct fvs_vnode);
+	_reset_block(&dpg);
+
+	for (i = nr; i > 0; i--) {
+		v = i * 3;
+		fvs_vnode_write(&dpg, i, _DATA_SZ, &v);
+	}
+	/* roll the page once to compact the vnodes */
+	w = (dpg.size - nr * _NODE_SZ) / _NODE_SZ + 1;
+	for (i = 0; i < w; i++)
+		fvs_vnode_write(&dpg, nr, _DATA_SZ, &i);
+
+	/* the directory is the first record, with the number of entries */
+	node = (struct fvs_vnode*)dpg.pages[1];
+	if (FVS_VN_STATUS((struct fvs_vnode*)(dpg.pages[1] + dpg.size)) != 0 ||
+	    node->id != 0 || (node->size & ((fvs_size_t)-1 >> 3)) != nr) {
+		rt_kprintf("fvs directory fail\n");
+		rt_kprintf("expect directory of %d vnodes on page 1\n", nr);
+		return -RT_ERROR;
+	}
+	ent = (fvs_native_t*)(node+1);
+	for (i = 0; i < nr; i++) {
+		node = (struct fvs_vnode*)(dpg.pages[1] + ent[i]);
+		if (node->id != i + 1) {
+			rt_kprintf("fvs directory fail\n");
+			rt_kprintf("expect sorted id %d, get %d\n", i + 1, node->id);
+			return -RT_ERROR;
+		}
+	}
+
+	for (i = 1; i <= nr; i++) {
+		if (fvs_vnode_read(&dpg, i, _DATA_SZ, &v) != RT_EOK ||
+		    v != (i == nr ? w - 1 : i * 3)) {
+			rt_kprintf("fvs directory read fail on i = %d\n", i);
+			return -RT_ERROR;
+		}
+	}
+	if (fvs_vnode_peek(&dpg, nr + 1, _DATA_SZ) != -RT_EEMPTY ||
+	    fvs_vnode_peek(&dpg, 1, 2 * _DATA_SZ) != -RT_EEMPTY) {
+		rt_kprintf("fvs directory peek absent vnode fail\n");
+		return -RT_ERROR;
+	}
+
+	rt_kprintf("fvs directory pass\n");
+	return RT_EOK;
+}
+
+static rt_err_t _test_patch(const struct fvs_block *pg)
+{
+	struct fvs_block ppg = *pg;
+	int v[8], r[8], i, plen;
+	char *p, *np;
+	struct fvs_vnode *h, fh;
+
+	/* a larger page to hold the full copies written by get */
+	ppg.size = 2 * _PAGE_SZ - sizeof(struct fvs_vnode);
+	_reset_block(&ppg);
+
+	/* write without get, so the changed words are patched */
+	for (i = 0; i < 8; i++)
+		v[i] = i;
+	fvs_vnode_write(&ppg, 1, sizeof(v), v);
+	p = (char*)ppg.pages[0] + sizeof(struct fvs_vnode);
+
+	v[3] = 0x55AA;
+	fvs_vnode_write(&ppg, 1, sizeof(v), v);
+	if (fvs_vnode_read(&ppg, 1, sizeof(v), r) != RT_EOK ||
+	    rt_memcmp(r, v, sizeof(v)) != 0) {
+		rt_kprintf("fvs patch read fail\n");
+		rt_kprintf("expect 0x%X, get 0x%X\n", v[3], r[3]);
+		return -RT_ERROR;
+	}
+
+	/* a patch header without data, as if the power was lost right after it
+	 * was written, is walked over by the size in it */
+	plen = _UNIT_ALIGN(2 * FVS_PATCH_PAIR_NR * sizeof(fvs_native_t));
+	h = (struct fvs_vnode*)(p + sizeof(v) + sizeof(struct fvs_vnode) + plen);
+	rt_memset(&fh, 0xFF, sizeof(fh));
+	fh.id = 1;
+	fh.size = sizeof(v) | ((fvs_size_t)1 << (sizeof(fvs_size_t) * 8 - 2));
+	fvs_begin_write(h);
+	fvs_native_write_m(h, (rt_uint8_t*)&fh,
+			(rt_uint8_t*)&FVS_VN_STATUS(&fh) - (rt_uint8_t*)&fh);
+	fvs_end_write(h);
+
+	/* only the changed words and their indexes are appended */
+	np = fvs_vnode_get(&ppg, 2, _DATA_SZ);
+	if (np - p != sizeof(v) + 3 * sizeof(struct fvs_vnode) + 2 * plen) {
+		rt_kprintf("fvs patch size fail\n");
+		rt_kprintf("expect patch of %d words\n", 2 * FVS_PATCH_PAIR_NR);
+		return -RT_ERROR;
+	}
+
+	/* the patch is folded into a full copy to be pointed */
+	p = fvs_vnode_get(&ppg, 1, sizeof(v));
+	if (rt_memcmp(p, v, sizeof(v)) != 0) {
+		rt_kprintf("fvs patch get fail\n");
+		rt_kprintf("expect 0x%X, get 0x%X\n", v[3], ((int*)p)[3]);
+		return -RT_ERROR;
+	}
+
+	/* the pointed vnode is written in full and never folded again */
+	v[5] = 0x55AA;
+	fvs_vnode_write(&ppg, 1, sizeof(v), v);
+	np = fvs_vnode_get(&ppg, 1, sizeof(v));
+	if (np - p != sizeof(v) + sizeof(struct fvs_vnode) ||
+	    rt_memcmp(np, v, sizeof(v)) != 0) {
+		rt_kprintf("fvs pointed write fail\n");
+		rt_kprintf("expect node %p, get node %p\n",
+		           p + sizeof(v) + sizeof(struct fvs_vnode), np);
+		return -RT_ERROR;
+	}
+
+	if (fvs_vnode_read(&ppg, 3, _DATA_SZ, r) != -RT_EEMPTY) {
+		rt_kprintf("fvs read absent vnode fail\n");
+		return -RT_ERROR;
+	}
+
+	rt_kprintf("fvs patch pass\n");
+	return RT_EOK;
+}
+
+#ifdef FVS_USING_GOVERNOR
+static rt_bool_t _on_flash(const struct fvs_block *pg, const void *p)
+{
+	int i;
+
+	for (i = 0; i < FVS_BLK_PAGE_NR; i++) {
+		if ((rt_uint8_t*)p >= pg->pages[i] &&
+		    (rt_uint8_t*)p < pg->pages[i] + pg->size)
+			return RT_TRUE;
+	}
+	return RT_FALSE;
+}
+
+static rt_err_t _test_governor(const struct fvs_block *pg)
+{
+	/* one erase per hour */
+	struct fvs_governor gov = FVS_GOVERNOR_INIT(1, RT_TICK_PER_SECOND*3600, 0);
+	/* three writes of each vnode per hour */
+	struct fvs_governor hot = FVS_GOVERNOR_INIT(100, RT_TICK_PER_SECOND*3600, 3);
+	struct fvs_block gpg = *pg;
+	rt_err_t res = RT_EOK;
+	int i, v = 0, *p;
+
+	gpg.gov = &gov;
+	_reset_block(&gpg);
+
+	fvs_vnode_get(&gpg, 1, _DATA_SZ);
+	for (i = 0; i < _NODE_PER_PAGE * 4; i++)
+		fvs_vnode_write(&gpg, 1, _DATA_SZ, &i);
+
+	if (gov.erases != 1 || gov.ids[0].coalesced == 0) {
+		rt_kprintf("fvs governor fail\n");
+		rt_kprintf("expect 1 erase, get %d, coalesced %d\n",
+				gov.erases, gov.ids[0].coalesced);
+		return -RT_ERROR;
+	}
+
+	i--;
+	p = fvs_vnode_get(&gpg, 1, _DATA_SZ);
+	if (*p != i) {
+		rt_kprintf("fvs governor fail\n");
+		rt_kprintf("expect coalesced data %d, get %d\n", i, *p);
+		return -RT_ERROR;
+	}
+
+	fvs_gov_flush(&gpg, RT_TRUE);
+	p = fvs_vnode_get(&gpg, 1, _DATA_SZ);
+	if (*p != i || gov.slots[0].dirty ||
+	    !_on_flash(&gpg, p)) {
+		rt_kprintf("fvs governor fail\n");
+		rt_kprintf("expect %d on flash, get %d at 0x%p\n", i, *p, p);
+		return -RT_ERROR;
+	}
+
+	/* the write is not acknowledged if there is no room to create the vnode,
+	 * even if the block is throttled */
+	for (i = 2; i < _PAGE_SZ; i++) {
+		res = fvs_vnode_write(&gpg, i, _DATA_SZ, &i);
+		if (res != RT_EOK)
+			break;
+	}
+	if (res != -RT_EFULL || fvs_gov_flush(&gpg, RT_TRUE) != RT_EOK) {
+		rt_kprintf("fvs governor fail\n");
+		rt_kprintf("expect full block on %d, get %d\n", i, res);
+		return -RT_ERROR;
+	}
+	rt_memset(gov.slots, 0, sizeof(gov.slots));
+	while (--i > 1) {
+		if (fvs_vnode_read(&gpg, i, _DATA_SZ, &v) != RT_EOK || v != i) {
+			rt_kprintf("fvs governor fail\n");
+			rt_kprintf("expect %d on flash, get %d\n", i, v);
+			return -RT_ERROR;
+		}
+	}
+
+	/* each vnode is counted even if there are more vnodes than the slots */
+	gpg.gov = &hot;
+	_reset_block(&gpg);
+	for (v = 0; v < 20; v++) {
+		for (i = 1; i <= FVS_GOV_SLOT_NR + 1; i++)
+			fvs_vnode_write(&gpg, i, _DATA_SZ, &v);
+	}
+	for (i = 0; i < FVS_GOV_SLOT_NR + 1; i++) {
+		if (hot.ids[i].writes + hot.ids[i].coalesced != v ||
+		    hot.ids[i].coalesced + hot.overflow == 0) {
+			rt_kprintf("fvs governor fail\n");
+			rt_kprintf("expect %d writes of id %d, get %d and %d coalesced\n",
+					v, hot.ids[i].id, hot.ids[i].writes,
+					hot.ids[i].coalesced);
+			return -RT_ERROR;
+		}
+	}
+
+	rt_kprintf("fvs governor pass\n");
+	return RT_EOK;
+}
+#endif
+#endif
+
+#ifdef FVS_USING_TRACE
+static rt_err_t _test_trace(const struct fvs_block *pg)
+{
+	struct fvs_trace_event evt[FVS_TRACE_NR];
+	rt_size_t i, nr;
+
+	/* drop the events of the former tests */
+	while (fvs_trace_read(evt, FVS_TRACE_NR))
+		;
+	fvs_trace_lost();
+
+	/* wrap around the ring by 3 events */
+	for (i = 1; i <= FVS_TRACE_NR + 3; i++)
+		fvs_vnode_peek(pg, i, _DATA_SZ);
+
+	if (fvs_trace_lost() != 3 || fvs_trace_lost() != 0) {
+		rt_kprintf("fvs trace lost count fail\n");
+		return -RT_ERROR;
+	}
+
+	/* read in two parts to check the order across reads */
+	nr = fvs_trace_read(evt, FVS_TRACE_NR / 2);
+	nr += fvs_trace_read(evt + nr, FVS_TRACE_NR);
+	if (nr != FVS_TRACE_NR) {
+		rt_kprintf("fvs trace read fail\n");
+		rt_kprintf("expect %d events, get %d\n", FVS_TRACE_NR, nr);
+		return -RT_ERROR;
+	}
+	for (i = 0; i < nr; i++) {
+		/* the oldest 3 events are overwritten */
+		if (evt[i].op != FVS_TRACE_GET || evt[i].id != i + 4 ||
+		    evt[i].size != _DATA_SZ) {
+			rt_kprintf("fvs trace order fail\n");
+			rt_kprintf("expect id %d, get %d\n", i + 4, evt[i].id);
+			return -RT_ERROR;
+		}
+	}
+	if (fvs_trace_read(evt, 1) != 0) {
+		rt_kprintf("fvs trace read empty ring fail\n");
+		return -RT_ERROR;
+	}
+
+	rt_kprintf("fvs trace pass\n");
+	return RT_EOK;
+}
+#endif
 
 rt_err_t fvs_test(void)
 {
 	rt_err_t res;
-	int i;
 
 	// stm32f10x
 	/*
@@ -157,26 +700,47 @@ rt_err_t fvs_test(void)
 	 *        _PAGE_SZ);
 	 */
 
+#ifdef FVS_SIM_PAGE
+	// simulator
+	const FVS_DEFINE_BLOCK(tst_pg,
+			FVS_SIM_PAGE(0),
+			FVS_SIM_PAGE(1),
+			_PAGE_SZ);
+#else
 	// efm32gg980
 	const FVS_DEFINE_BLOCK(tst_pg,
 			(void*)0x7F000,
 			(void*)0x7E000,
 			_PAGE_SZ);
+#endif
 
 
 	rt_kprintf("fvs test begin\n");
-	/* reset the block */
-	for (i = 0; i < FVS_BLK_PAGE_NR; i++)
-	{
-		fvs_begin_write((void*)tst_pg.pages[i]);
-		fvs_erase_page((void*)tst_pg.pages[i]);
-		fvs_end_write((void*)tst_pg.pages[i]);
-	}
+	_reset_block(&tst_pg);
 
+#ifndef FVS_HAL_NO_MMAP
 	_RETURN_ON_FAIL(_test_vnode_get(&tst_pg));
 	_RETURN_ON_FAIL(_test_simple_write(&tst_pg));
 	_RETURN_ON_FAIL(_test_rewrite(&tst_pg));
 	_RETURN_ON_FAIL(_test_del(&tst_pg));
+	_RETURN_ON_FAIL(_test_seq(&tst_pg));
+	_RETURN_ON_FAIL(_test_patch(&tst_pg));
+	_RETURN_ON_FAIL(_test_dir(&tst_pg));
+#ifdef FVS_USING_GOVERNOR
+	_RETURN_ON_FAIL(_test_governor(&tst_pg));
+#endif
+#endif
+	_RETURN_ON_FAIL(_test_copy(&tst_pg));
+	_RETURN_ON_FAIL(_test_peek(&tst_pg));
+#ifdef FVS_SIM_PAGE
+	_RETURN_ON_FAIL(_test_prog_unit(&tst_pg));
+#endif
+#ifdef FVS_SIM_SPI_NOR
+	_RETURN_ON_FAIL(_test_read_fail(&tst_pg));
+#endif
+#ifdef FVS_USING_TRACE
+	_RETURN_ON_FAIL(_test_trace(&tst_pg));
+#endif
 
 	return res;
 }
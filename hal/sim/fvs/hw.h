@@ -0,0 +1,58 @@
+#ifndef __HW_H_
+#define __HW_H_
+
+typedef uint32_t fvs_native_t;
+
+/* geometry of the simulated flash */
+#ifndef FVS_SIM_PAGE_SZ
+#define FVS_SIM_PAGE_SZ 2048
+#endif
+#ifndef FVS_SIM_PAGE_NR
+#define FVS_SIM_PAGE_NR 8
+#endif
+
+/* FVS_PROG_UNIT could be defined to simulate the flash programmed in wider
+ * units, like the flash with ECC. */
+
+/* cost model of the simulated flash, in micro seconds, per program unit */
+#ifndef FVS_SIM_PROG_US
+#define FVS_SIM_PROG_US  40
+#endif
+#ifndef FVS_SIM_ERASE_US
+#define FVS_SIM_ERASE_US 20000
+#endif
+
+struct fvs_sim_stat {
+	/* read transactions, only counted when the flash is not memory mapped */
+	rt_uint32_t read_nr;
+	rt_uint32_t read_bytes;
+	rt_uint32_t prog_nr;
+	rt_uint32_t prog_bytes;
+	rt_uint32_t prog_fail;
+	rt_uint32_t erase_nr[FVS_SIM_PAGE_NR];
+	/* the simulated time spent on flash operations */
+	rt_uint32_t time_us;
+};
+
+extern rt_uint8_t fvs_sim_flash[FVS_SIM_PAGE_NR * FVS_SIM_PAGE_SZ];
+extern struct fvs_sim_stat fvs_sim_stat;
+
+#ifdef FVS_SIM_SPI_NOR
+/* Simulate the flash which is not memory mapped, like the SPI NOR flash. The
+ * addresses given to FVS are not dereferenceable. */
+#define FVS_HAL_NO_MMAP
+#define FVS_SIM_BASE ((rt_uint8_t*)0x90000000)
+
+/* fvs_read fails from the read_nr th read on, to test the read errors. 0 for
+ * never. */
+extern rt_uint32_t fvs_sim_read_fail_at;
+#else
+#define FVS_SIM_BASE fvs_sim_flash
+#endif
+
+#define FVS_SIM_PAGE(n) (FVS_SIM_BASE + (n) * FVS_SIM_PAGE_SZ)
+
+/** erase the whole simulated flash and clear the statistics */
+void fvs_sim_reset(void);
+
+#endif /* end of include guard: __HW_H_ */
@@ -0,0 +1,129 @@
+/* RAM backed flash for the simulator and the host tools. It follows the NOR
+ * flash rules: programming could only clear bits and erasing sets the whole
+ * page to 0xFF. Besides, the flash is programmed in whole FVS_PROG_UNIT once
+ * after erased, like the flash with ECC. */
+
+#include <fvs.h>
+
+rt_uint8_t fvs_sim_flash[FVS_SIM_PAGE_NR * FVS_SIM_PAGE_SZ]
+	__attribute__((aligned(FVS_PROG_UNIT)));
+struct fvs_sim_stat fvs_sim_stat;
+
+/* whether each program unit has been programmed since erased */
+static rt_uint8_t _programmed[sizeof(fvs_sim_flash) / FVS_PROG_UNIT];
+
+/* translate the flash address to the RAM behind it */
+static rt_uint8_t *sim_ptr(void *addr)
+{
+	rt_uint8_t *p = fvs_sim_flash + ((rt_uint8_t*)addr - FVS_SIM_BASE);
+
+	RT_ASSERT(p >= fvs_sim_flash);
+	RT_ASSERT(p < fvs_sim_flash + sizeof(fvs_sim_flash));
+	return p;
+}
+
+static int sim_page_idx(void *addr)
+{
+	return (sim_ptr(addr) - fvs_sim_flash) / FVS_SIM_PAGE_SZ;
+}
+
+void fvs_sim_reset(void)
+{
+	rt_memset(fvs_sim_flash, 0xFF, sizeof(fvs_sim_flash));
+	rt_memset(_programmed, 0, sizeof(_programmed));
+	rt_memset(&fvs_sim_stat, 0, sizeof(fvs_sim_stat));
+#ifdef FVS_SIM_SPI_NOR
+	fvs_cache_invalidate();
+#endif
+}
+
+rt_err_t fvs_begin_write(void *addr)
+{
+	return RT_EOK;
+}
+
+/* Program the whole units. Each unit could only be programmed once, it's
+ * counted as a failure to program a part of or to reprogram a unit. */
+static rt_err_t sim_prog(void *addr, const rt_uint8_t *data, rt_size_t len)
+{
+	rt_uint8_t *p = sim_ptr(addr);
+	rt_size_t i;
+
+	fvs_sim_stat.prog_nr += len / FVS_PROG_UNIT;
+	fvs_sim_stat.prog_bytes += len;
+	fvs_sim_stat.time_us += len / FVS_PROG_UNIT * FVS_SIM_PROG_US;
+
+	if (((rt_ubase_t)addr | len) & (FVS_PROG_UNIT-1)) {
+		fvs_sim_stat.prog_fail++;
+		return -RT_EIO;
+	}
+
+	for (i = 0; i < len; i++) {
+		rt_uint8_t *u = &_programmed[(p - fvs_sim_flash + i) / FVS_PROG_UNIT];
+
+		if (i % FVS_PROG_UNIT == 0 && *u) {
+			fvs_sim_stat.prog_fail++;
+			return -RT_EIO;
+		}
+		*u = 1;
+
+		/* bits could only go from 1 to 0 */
+		if ((p[i] & data[i]) != data[i]) {
+			fvs_sim_stat.prog_fail++;
+			p[i] &= data[i];
+			return -RT_EIO;
+		}
+		p[i] = data[i];
+	}
+
+	return RT_EOK;
+}
+
+rt_err_t fvs_native_write_r(void *addr, fvs_native_t data)
+{
+	fvs_debug("FVS: write %X to 0x%p\n", data, addr);
+
+	return sim_prog(addr, (rt_uint8_t*)&data, sizeof(data));
+}
+
+rt_err_t fvs_native_write_m(void *addr, rt_uint8_t *data, rt_size_t len)
+{
+	fvs_debug("FVS: write %d bytes of data to 0x%p\n", len, addr);
+
+	return sim_prog(addr, data, len);
+}
+
+rt_err_t fvs_end_write(void *addr)
+{
+	return RT_EOK;
+}
+
+rt_err_t fvs_erase_page(void *addr)
+{
+	int idx = sim_page_idx(addr);
+
+	RT_ASSERT((rt_uint8_t*)addr == FVS_SIM_PAGE(idx));
+
+	rt_memset(sim_ptr(addr), 0xFF, FVS_SIM_PAGE_SZ);
+	rt_memset(&_programmed[(sim_ptr(addr) - fvs_sim_flash) / FVS_PROG_UNIT],
+			0, FVS_SIM_PAGE_SZ / FVS_PROG_UNIT);
+	fvs_sim_stat.erase_nr[idx]++;
+	fvs_sim_stat.time_us += FVS_SIM_ERASE_US;
+	return RT_EOK;
+}
+
+#ifdef FVS_SIM_SPI_NOR
+rt_uint32_t fvs_sim_read_fail_at;
+
+rt_err_t fvs_read(void *addr, void *buf, rt_size_t len)
+{
+	fvs_debug("FVS: read %d bytes from 0x%p\n", len, addr);
+
+	fvs_sim_stat.read_nr++;
+	if (fvs_sim_read_fail_at && fvs_sim_stat.read_nr >= fvs_sim_read_fail_at)
+		return -RT_EIO;
+	fvs_sim_stat.read_bytes += len;
+	rt_memcpy(buf, sim_ptr(addr), len);
+	return RT_EOK;
+}
+#endif